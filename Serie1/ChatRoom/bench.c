@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <uuid/uuid.h>
+
+#include "protocol.h"
+#include "ring.h"
+
+#define MAX_EVENTS 64
+#define JOIN_TIMEOUT 10         // seconds for every client to be welcomed
+#define DRAIN_TIMEOUT 3         // seconds without progress before giving up
+#define MAX_SAMPLES (1u << 24)
+#define ROOM_DIR_LEN 300
+#define UUID_LEN 40             // uuid_unparse writes 36 characters and a NUL
+// <room_dir>/<uuid>_server_fifo always fits, so the snprintf never truncates
+#define FIFO_PATH_LEN (ROOM_DIR_LEN + 1 + UUID_LEN + sizeof("_server_fifo"))
+
+// One synthetic chat client
+typedef struct {
+    char uuid[UUID_LEN];
+    char client_fifo[FIFO_PATH_LEN];
+    char server_fifo[FIFO_PATH_LEN];
+    int in_fd;
+    int out_fd;
+    FrameReader *in;
+    uint64_t join_start;
+    uint64_t join_ns;           // registration to welcome
+    int joined;
+    int has_ring;
+    Ring ring;                  // own cursor over the room's shared ring
+} BenchClient;
+
+BenchClient *clients;
+int num_clients = 10;
+int num_senders = 1;
+double rate = 1000;             // messages per second, all senders together
+size_t msg_size = 64;
+double duration = 5;
+const char *room_name = NULL;
+int use_socket = 0;             // join through <dir>/chat.sock instead of FIFOs
+const char *root;
+char room_dir[ROOM_DIR_LEN];
+
+// Identifies this run's messages; anything else (e.g. history replayed on
+// join) is ignored.
+uint32_t run_id;
+
+// Latency of every delivery, in nanoseconds
+uint64_t *samples;
+atomic_size_t num_samples;
+atomic_uint_fast64_t delivered;
+atomic_uint_fast64_t lapped;
+atomic_uint_fast64_t last_delivery;
+atomic_int joined_count;
+atomic_int disconnected;
+atomic_int stop;
+
+Ring room_ring;
+int room_ring_mapped = 0;
+
+
+uint64_t now_ns(void);
+int setup_client(BenchClient *c);
+int register_client(BenchClient *c, int i, int main_fd);
+int connect_client(BenchClient *c, int i);
+void *receiver_thread(void *arg);
+void *ring_thread(void *arg);
+void handle_frame(BenchClient *c, const struct frame_header *h, const char *payload);
+int compare_u64(const void *a, const void *b);
+uint64_t percentile(const uint64_t *sorted, size_t n, double p);
+
+
+static void usage(void)
+{
+    printf("Usage: ./bench [--clients N] [--senders N] [--rate MSGS_PER_SEC] [--size BYTES]\n"
+           "               [--duration SECONDS] [--room NAME] [--socket] <server dir>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "clients",  required_argument, NULL, 'c' },
+        { "senders",  required_argument, NULL, 's' },
+        { "rate",     required_argument, NULL, 'r' },
+        { "size",     required_argument, NULL, 'b' },
+        { "duration", required_argument, NULL, 'd' },
+        { "room",     required_argument, NULL, 'R' },
+        { "socket",   no_argument,       NULL, 'u' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'c': num_clients = atoi(optarg); break;
+        case 's': num_senders = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'b': msg_size = strtoul(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        case 'R': room_name = optarg; break;
+        case 'u': use_socket = 1; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1 || num_clients < 1 || rate <= 0 || duration <= 0) {
+        usage();
+        return 1;
+    }
+    if (num_senders < 1) num_senders = 1;
+    if (num_senders > num_clients) num_senders = num_clients;
+    if (msg_size > FRAME_MAX_PAYLOAD) msg_size = FRAME_MAX_PAYLOAD;
+
+    root = argv[optind];
+    if (room_name)
+        snprintf(room_dir, sizeof(room_dir), "%s/%s", root, room_name);
+    else
+        snprintf(room_dir, sizeof(room_dir), "%s", root);
+
+    srand(time(NULL) ^ getpid());
+    run_id = rand();
+
+    clients = calloc(num_clients, sizeof(BenchClient));
+    samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    if (!clients || !samples) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_t receiver;
+
+    if (use_socket) {
+        // One connection per client; the registration is its first packet.
+        pthread_create(&receiver, NULL, receiver_thread, (void *)(intptr_t)epfd);
+        for (int i = 0; i < num_clients; i++) {
+            if (connect_client(&clients[i], i) == -1) return 1;
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &clients[i] };
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].in_fd, &ev);
+        }
+    } else {
+        char main_fifo[320];
+        snprintf(main_fifo, sizeof(main_fifo), "%s/main_fifo", root);
+        int main_fd = open(main_fifo, O_WRONLY | O_NONBLOCK);
+        if (main_fd == -1) {
+            fprintf(stderr, "Cannot connect to server.\n");
+            return 1;
+        }
+        // Registrations from many clients may fill the FIFO; wait rather than fail.
+        fcntl(main_fd, F_SETFL, 0);
+
+        mkdir(room_dir, 0777);
+        for (int i = 0; i < num_clients; i++) {
+            if (setup_client(&clients[i]) == -1) return 1;
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &clients[i] };
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].in_fd, &ev);
+        }
+
+        pthread_create(&receiver, NULL, receiver_thread, (void *)(intptr_t)epfd);
+
+        // Real join protocol: every client registers through main_fifo.
+        for (int i = 0; i < num_clients; i++)
+            if (register_client(&clients[i], i, main_fd) == -1) return 1;
+        close(main_fd);
+    }
+
+    uint64_t deadline = now_ns() + JOIN_TIMEOUT * 1000000000ull;
+    while (atomic_load(&joined_count) < num_clients) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "Only %d of %d clients joined.\n", atomic_load(&joined_count), num_clients);
+            return 1;
+        }
+        usleep(1000);
+    }
+
+    for (int i = 0; i < num_clients && !use_socket; i++) {
+        clients[i].out_fd = open(clients[i].client_fifo, O_WRONLY);
+        if (clients[i].out_fd == -1) {
+            perror(clients[i].client_fifo);
+            return 1;
+        }
+    }
+
+    pthread_t ringer;
+    if (room_ring_mapped)
+        pthread_create(&ringer, NULL, ring_thread, NULL);
+
+    // Open loop: messages go out on a fixed schedule no matter how fast
+    // the server delivers them, round robin over the senders.
+    char *payload = malloc(FRAME_MAX_PAYLOAD + 64);
+    if (!payload) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uint64_t total = rate * duration;
+    uint64_t interval = 1e9 / rate;
+    uint64_t start = now_ns();
+    uint64_t sent = 0;
+
+    for (uint64_t i = 0; i < total; i++) {
+        uint64_t due = start + i * interval;
+        struct timespec ts = { due / 1000000000, due % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        int len = snprintf(payload, 64, "%08" PRIx32 " %" PRIu64 " %" PRIu64 " ",
+                           run_id, i, now_ns());
+        if ((size_t)len < msg_size) {
+            memset(payload + len, 'x', msg_size - len);
+            len = msg_size;
+        }
+
+        struct frame_header h;
+        frame_init(&h, FRAME_MSG, i + 1, NULL, NULL, len);
+        if (frame_send(clients[i % num_senders].out_fd, &h, payload) == 0)
+            sent++;
+    }
+    uint64_t send_end = now_ns();
+
+    // Wait for the fan-out to finish, or to stop making progress.
+    uint64_t expected = sent * num_clients;
+    uint64_t seen = 0, progress = now_ns();
+    while (atomic_load(&delivered) < expected) {
+        uint64_t d = atomic_load(&delivered);
+        if (d != seen) {
+            seen = d;
+            progress = now_ns();
+        } else if (now_ns() - progress > DRAIN_TIMEOUT * 1000000000ull) {
+            break;
+        }
+        usleep(1000);
+    }
+    atomic_store(&stop, 1);
+
+    for (int i = 0; i < num_clients; i++) {
+        struct frame_header h;
+        frame_init(&h, FRAME_CLOSE, 0, NULL, NULL, 0);
+        frame_send(clients[i].out_fd, &h, NULL);
+        if (!use_socket) close(clients[i].out_fd);
+    }
+
+    size_t n = atomic_load(&num_samples);
+    if (n > MAX_SAMPLES) n = MAX_SAMPLES;
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+
+    uint64_t *joins = malloc(num_clients * sizeof(uint64_t));
+    if (!joins) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < num_clients; i++)
+        joins[i] = clients[i].join_ns;
+    qsort(joins, num_clients, sizeof(uint64_t), compare_u64);
+
+    uint64_t got = atomic_load(&delivered);
+    uint64_t last = atomic_load(&last_delivery);
+    double span = (last > start ? last - start : send_end - start) / 1e9;
+
+    printf("{\n");
+    printf("  \"transport\": \"%s%s\",\n", use_socket ? "socket" : "fifo",
+           room_ring_mapped ? "+shm" : "");
+    printf("  \"clients\": %d,\n", num_clients);
+    printf("  \"senders\": %d,\n", num_senders);
+    printf("  \"rate\": %.0f,\n", rate);
+    printf("  \"size\": %zu,\n", msg_size);
+    printf("  \"duration_s\": %.3f,\n", (send_end - start) / 1e9);
+    printf("  \"sent\": %" PRIu64 ",\n", sent);
+    printf("  \"expected\": %" PRIu64 ",\n", expected);
+    printf("  \"delivered\": %" PRIu64 ",\n", got);
+    printf("  \"lost\": %" PRIu64 ",\n", got < expected ? expected - got : 0);
+    printf("  \"lapped\": %" PRIu64 ",\n", (uint64_t)atomic_load(&lapped));
+    printf("  \"disconnected\": %d,\n", atomic_load(&disconnected));
+    printf("  \"delivered_per_sec\": %.0f,\n", span > 0 ? got / span : 0);
+    printf("  \"latency_us\": { \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f },\n",
+           percentile(samples, n, 0.50) / 1e3, percentile(samples, n, 0.99) / 1e3,
+           percentile(samples, n, 0.999) / 1e3, n ? samples[n - 1] / 1e3 : 0);
+    printf("  \"join_us\": { \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f }\n",
+           percentile(joins, num_clients, 0.50) / 1e3, percentile(joins, num_clients, 0.99) / 1e3,
+           joins[num_clients - 1] / 1e3);
+    printf("}\n");
+
+    // The server unlinks the FIFOs when it sees the close frames.
+    return got < expected;
+}
+
+
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Create and open the client's FIFOs before it registers, as client.c does.
+int setup_client(BenchClient *c)
+{
+    uuid_t u;
+    uuid_generate(u);
+    uuid_unparse(u, c->uuid);
+    snprintf(c->client_fifo, sizeof(c->client_fifo), "%s/%s_client_fifo", room_dir, c->uuid);
+    snprintf(c->server_fifo, sizeof(c->server_fifo), "%s/%s_server_fifo", room_dir, c->uuid);
+
+    c->in = malloc(sizeof(FrameReader));
+    if (!c->in) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    c->in->len = c->in->start = 0;
+
+    if (mkfifo(c->client_fifo, 0666) == -1 || mkfifo(c->server_fifo, 0666) == -1) {
+        perror("mkfifo");
+        return -1;
+    }
+
+    c->in_fd = open(c->server_fifo, O_RDONLY | O_NONBLOCK);
+    if (c->in_fd == -1) {
+        perror(c->server_fifo);
+        return -1;
+    }
+    return 0;
+}
+
+int register_client(BenchClient *c, int i, int main_fd)
+{
+    char reg[200];
+    int len;
+    if (room_name)
+        len = snprintf(reg, sizeof(reg), "bench%d:%s:%s\n", i, c->uuid, room_name);
+    else
+        len = snprintf(reg, sizeof(reg), "bench%d:%s\n", i, c->uuid);
+
+    c->join_start = now_ns();
+    if (write(main_fd, reg, len) != len) {
+        perror("register");
+        return -1;
+    }
+    return 0;
+}
+
+// --socket: one blocking connection carries both directions.
+int connect_client(BenchClient *c, int i)
+{
+    uuid_t u;
+    uuid_generate(u);
+    uuid_unparse(u, c->uuid);
+
+    c->in = malloc(sizeof(FrameReader));
+    if (!c->in) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    c->in->len = c->in->start = 0;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/chat.sock", root);
+
+    c->in_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (c->in_fd == -1 || connect(c->in_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(addr.sun_path);
+        return -1;
+    }
+    c->out_fd = c->in_fd;
+
+    char reg[200];
+    int len;
+    if (room_name)
+        len = snprintf(reg, sizeof(reg), "bench%d:%s:%s\n", i, c->uuid, room_name);
+    else
+        len = snprintf(reg, sizeof(reg), "bench%d:%s\n", i, c->uuid);
+
+    c->join_start = now_ns();
+    if (send(c->in_fd, reg, len, MSG_NOSIGNAL) != len) {
+        perror("register");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads every client's server FIFO: welcomes, and broadcasts unless the
+// room uses the shared ring.
+void *receiver_thread(void *arg)
+{
+    int epfd = (intptr_t)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&stop)) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            BenchClient *c = events[i].data.ptr;
+            struct frame_header h;
+            const char *payload;
+            ssize_t r;
+
+            // A blocking socket gives one packet per read and would stall
+            // once drained; level-triggered epoll comes back for the rest.
+            do {
+                r = frame_fill(c->in, c->in_fd);
+                while (frame_next(c->in, &h, &payload) == 1)
+                    handle_frame(c, &h, payload);
+            } while (r > 0 && !use_socket);
+
+            if (r == 0 && !atomic_load(&stop)) {
+                // The server dropped this client.
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->in_fd, NULL);
+                atomic_fetch_add(&disconnected, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// --shm rooms: follow every client's cursor over the one shared mapping,
+// sleeping on the ring's futex when all of them are caught up.
+void *ring_thread(void *arg)
+{
+    static uint64_t buf[RING_MAX_RECORD / 8];
+    struct ring_record *rec = (struct ring_record *)buf;
+    (void)arg;
+
+    while (!atomic_load(&stop)) {
+        uint32_t seq = atomic_load(&room_ring.hdr->futex);
+        int busy = 0;
+
+        for (int i = 0; i < num_clients; i++) {
+            BenchClient *c = &clients[i];
+            int rc;
+            if (!c->has_ring) continue;
+            while ((rc = ring_poll(&c->ring, rec)) != -1) {
+                busy = 1;
+                if (rc == 0)
+                    atomic_fetch_add(&lapped, 1);
+                else
+                    handle_frame(c, &rec->frame, rec->payload);
+            }
+        }
+
+        if (!busy) {
+            struct timespec timeout = { 0, 100000000 };
+            atomic_fetch_add(&room_ring.hdr->waiters, 1);
+            syscall(SYS_futex, (uint32_t *)&room_ring.hdr->futex, FUTEX_WAIT, seq, &timeout, NULL, 0);
+            atomic_fetch_sub(&room_ring.hdr->waiters, 1);
+        }
+    }
+    return NULL;
+}
+
+void handle_frame(BenchClient *c, const struct frame_header *h, const char *payload)
+{
+    uint64_t t = now_ns();
+
+    if (h->type == FRAME_SYSTEM && (h->flags & FRAME_F_JOINED) && !c->joined) {
+        if (h->flags & FRAME_F_RING) {
+            // Only the receiver thread sees welcomes, and the ring thread
+            // starts after all of them.
+            if (!room_ring_mapped) {
+                char path[320];
+                snprintf(path, sizeof(path), "%s/ring", room_dir);
+                if (ring_attach(&room_ring, path) == -1) {
+                    perror(path);
+                    exit(1);
+                }
+                room_ring_mapped = 1;
+            }
+            c->ring = room_ring;
+            c->ring.cursor = h->seq;
+            c->has_ring = 1;
+        }
+        c->join_ns = t - c->join_start;
+        c->joined = 1;
+        atomic_fetch_add(&joined_count, 1);
+        return;
+    }
+
+    if (h->type != FRAME_MSG) return;
+
+    char head[64];
+    uint32_t id;
+    uint64_t msg, sent;
+    size_t len = h->len < sizeof(head) - 1 ? h->len : sizeof(head) - 1;
+    memcpy(head, payload, len);
+    head[len] = '\0';
+    if (sscanf(head, "%" SCNx32 " %" SCNu64 " %" SCNu64, &id, &msg, &sent) != 3 || id != run_id)
+        return;
+
+    size_t slot = atomic_fetch_add(&num_samples, 1);
+    if (slot < MAX_SAMPLES) samples[slot] = t - sent;
+    atomic_fetch_add(&delivered, 1);
+    atomic_store(&last_delivery, t);
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    if (n == 0) return 0;
+    size_t i = p * n;
+    return sorted[i < n ? i : n - 1];
+}
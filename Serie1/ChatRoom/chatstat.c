@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+// Counters summed over every server thread
+typedef struct {
+    uint64_t msgs_in, bytes_in;
+    uint64_t frames_out, bytes_out;
+    uint64_t ring_msgs, ring_bytes;
+    uint64_t dropped, failures;
+    uint64_t latency[STATS_BUCKETS];
+} Totals;
+
+
+void sum_blocks(const struct stats_page *s, Totals *t);
+void print_report(const struct stats_page *s, const Totals *now, const Totals *prev, double secs);
+void print_latency(const Totals *now, const Totals *prev);
+void print_clients(const struct stats_page *s);
+
+
+static void usage(void)
+{
+    printf("Usage: ./chatstat [--interval SECONDS] [--once] [--clients] <room>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "once",     no_argument,       NULL, 'o' },
+        { "clients",  no_argument,       NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    double interval = 1;
+    int once = 0, show_clients = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0) interval = 1;
+            break;
+        case 'o':
+            once = 1;
+            break;
+        case 'c':
+            show_clients = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage();
+        return 1;
+    }
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/stats", argv[optind]);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+
+    const struct stats_page *s = mmap(NULL, sizeof(struct stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (s->magic != STATS_MAGIC || s->version != STATS_VERSION) {
+        fprintf(stderr, "%s: not a stats page of this server version\n", path);
+        return 1;
+    }
+
+    // Rates are deltas between two samples; --once reports totals since
+    // the server started.
+    Totals prev, now;
+    memset(&prev, 0, sizeof(prev));
+    double elapsed = time(NULL) - s->started;
+    if (!once) {
+        sum_blocks(s, &prev);
+        elapsed = interval;
+    }
+
+    while (1) {
+        if (!once) {
+            struct timespec ts = { (time_t)interval, (interval - (time_t)interval) * 1e9 };
+            nanosleep(&ts, NULL);
+        }
+
+        sum_blocks(s, &now);
+        print_report(s, &now, &prev, elapsed > 0 ? elapsed : 1);
+        if (show_clients) print_clients(s);
+        fflush(stdout);
+
+        if (once) break;
+        prev = now;
+    }
+
+    return 0;
+}
+
+void sum_blocks(const struct stats_page *s, Totals *t)
+{
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i < STATS_BLOCKS; i++) {
+        const struct stats_block *b = &s->blocks[i];
+        t->msgs_in += b->msgs_in;
+        t->bytes_in += b->bytes_in;
+        t->frames_out += b->frames_out;
+        t->bytes_out += b->bytes_out;
+        t->ring_msgs += b->ring_msgs;
+        t->ring_bytes += b->ring_bytes;
+        t->dropped += b->dropped;
+        t->failures += b->failures;
+        for (int j = 0; j < STATS_BUCKETS; j++)
+            t->latency[j] += b->latency[j];
+    }
+}
+
+void print_report(const struct stats_page *s, const Totals *now, const Totals *prev, double secs)
+{
+    char stamp[32];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+
+    printf("[%s] pid %d  clients %d  rooms %d  shards %d  writers %d  joins %" PRIu64
+           "  leaves %" PRIu64 "\n", stamp, s->pid, s->clients, s->rooms, s->shards, s->writers,
+           (uint64_t)s->joins, (uint64_t)s->leaves);
+    printf("  in   %10.0f msg/s %12.0f B/s\n",
+           (now->msgs_in - prev->msgs_in) / secs, (now->bytes_in - prev->bytes_in) / secs);
+    printf("  out  %10.0f frames/s %9.0f B/s\n",
+           (now->frames_out - prev->frames_out) / secs, (now->bytes_out - prev->bytes_out) / secs);
+    if (now->ring_msgs)
+        printf("  ring %10.0f msg/s %12.0f B/s\n",
+               (now->ring_msgs - prev->ring_msgs) / secs, (now->ring_bytes - prev->ring_bytes) / secs);
+    printf("  dropped %" PRIu64 " (+%" PRIu64 ")  failed writes %" PRIu64 " (+%" PRIu64 ")\n",
+           now->dropped, now->dropped - prev->dropped, now->failures, now->failures - prev->failures);
+    print_latency(now, prev);
+}
+
+// Fan-out latency for this interval: broadcast received to frame written
+void print_latency(const Totals *now, const Totals *prev)
+{
+    uint64_t counts[STATS_BUCKETS], total = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        counts[i] = now->latency[i] - prev->latency[i];
+        total += counts[i];
+    }
+    if (total == 0) return;
+
+    printf("  fan-out latency:\n");
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (counts[i] == 0) continue;
+        char label[32];
+        if (i == 0)
+            snprintf(label, sizeof(label), "< 1us");
+        else if (i == STATS_BUCKETS - 1)
+            snprintf(label, sizeof(label), ">= %" PRIu64 "us", (uint64_t)1 << (i - 1));
+        else
+            snprintf(label, sizeof(label), "< %" PRIu64 "us", (uint64_t)1 << i);
+
+        int bar = counts[i] * 40 / total;
+        printf("    %12s %10" PRIu64 " %5.1f%% %.*s\n", label, counts[i],
+               counts[i] * 100.0 / total, bar, "########################################");
+    }
+}
+
+void print_clients(const struct stats_page *s)
+{
+    printf("  %-20s %-16s %10s %8s %10s %8s\n", "client", "room", "sent", "queued", "dropped", "failed");
+    for (int i = 0; i < STATS_CLIENTS; i++) {
+        const struct stats_client *c = &s->client_rows[i];
+        if (c->used != 2) continue;
+        printf("  %-20.20s %-16.16s %10" PRIu64 " %8" PRIu64 " %10" PRIu64 " %8" PRIu64 "\n",
+               c->name, c->room[0] ? c->room : "-", (uint64_t)c->frames_out, (uint64_t)c->queued,
+               (uint64_t)c->dropped, (uint64_t)c->failures);
+    }
+}
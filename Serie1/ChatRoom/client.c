@@ -1,96 +1,423 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <time.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <uuid/uuid.h>
 
-#define SLEEP_TIME 100000
+#include "protocol.h"
+#include "ring.h"
 
-char client_fifo[128];
-char server_fifo[128];
+#define JOIN_TIMEOUT 5  // seconds to wait for the welcome
+#define ROOM_LEN 100
+#define UUID_LEN 40
+// <room>/<uuid>_server_fifo always fits, so the path is never cut short
+#define FIFO_PATH_LEN (ROOM_LEN + 1 + UUID_LEN + sizeof("_server_fifo"))
+
+char client_fifo[FIFO_PATH_LEN];
+char server_fifo[FIFO_PATH_LEN];
 char username[50];
-char room[100];
-char uuid_str[40];
+char room[ROOM_LEN];
+char uuid_str[UUID_LEN];
+int in_fd;
+
+// --socket: one SOCK_SEQPACKET connection instead of two FIFOs
+int use_socket = 0;
+int passed_fd = -1;     // memfd that arrived ahead of its frame
+
+// Posted by the reader when the welcome arrives
+sem_t joined;
+atomic_int leaving = 0;
 
+// Newest room message printed, to resume from with --since
+_Atomic uint64_t last_seq = 0;
 
+// Set up when the welcome says the room broadcasts through <room>/ring
+Ring ring;
+int ring_attached = 0;
+
+
+int connect_socket(const char *path);
+int send_line(int fd, const char *msg, size_t len, uint64_t seq);
 void *reader(void *arg);
+void *ring_reader(void *arg);
+void print_frame(const struct frame_header *h, const char *payload);
 
 
+static void usage(void)
+{
+    printf("Usage: ./client [--socket] [--last N | --since SEQ] [--uuid UUID] <username> <room>\n");
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 3) {
-        printf("Usage: ./client <username> <room>\n");
-        return 1;
-    }
+    static const struct option opts[] = {
+        { "last",  required_argument, NULL, 'l' },
+        { "since", required_argument, NULL, 's' },
+        { "uuid",  required_argument, NULL, 'u' },
+        { "socket", no_argument,      NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
 
-    strcpy(username, argv[1]);
-    strcpy(room, argv[2]);
+    // Appended to the registration; the server's default replay otherwise
+    char replay[40] = "";
 
-    uuid_t u;
-    uuid_generate(u);
-    uuid_unparse(u, uuid_str);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            snprintf(replay, sizeof(replay), ":last=%llu", strtoull(optarg, NULL, 10));
+            break;
+        case 's':
+            snprintf(replay, sizeof(replay), ":since=%llu", strtoull(optarg, NULL, 10));
+            break;
+        case 'u':
+            // Rejoining under the same UUID replaces any old session.
+            if (strlen(optarg) != 36) {
+                usage();
+                return 1;
+            }
+            strcpy(uuid_str, optarg);
+            break;
+        case 'S':
+            use_socket = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
 
-    char main_fifo[128];
-    snprintf(main_fifo, sizeof(main_fifo), "%s/main_fifo", room);
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
 
-    char reg_msg[128];
-    snprintf(reg_msg, sizeof(reg_msg), "%s:%s", username, uuid_str);
+    snprintf(username, sizeof(username), "%s", argv[optind]);
+    snprintf(room, sizeof(room), "%s", argv[optind + 1]);
 
-    int main_fd = open(main_fifo, O_WRONLY);
-    if (main_fd == -1) {
-        printf("Cannot connect to server.\n");
-        return 1;
+    if (!uuid_str[0]) {
+        uuid_t u;
+        uuid_generate(u);
+        uuid_unparse(u, uuid_str);
     }
-    write(main_fd, reg_msg, strlen(reg_msg));
-    close(main_fd);
 
-    snprintf(client_fifo, sizeof(client_fifo), "%s/%s_client_fifo", room, uuid_str);
-    snprintf(server_fifo, sizeof(server_fifo), "%s/%s_server_fifo", room, uuid_str);
+    // A room with its own main_fifo (chat.sock with --socket) is served on
+    // its own.  Otherwise the room is <dir>/<name> on a server started as
+    // ./server <dir>, which creates the room when we join it.
+    const char *entry = use_socket ? "chat.sock" : "main_fifo";
+    char server_path[256];
+    char reg_msg[256];
+    snprintf(server_path, sizeof(server_path), "%s/%s", room, entry);
+    if (replay[0])
+        snprintf(reg_msg, sizeof(reg_msg), "%s:%s:%s\n", username, uuid_str, replay);
+    else
+        snprintf(reg_msg, sizeof(reg_msg), "%s:%s\n", username, uuid_str);
 
-    while (access(server_fifo, F_OK) != 0) usleep(SLEEP_TIME);
+    if (access(server_path, F_OK) != 0) {
+        char dir_buf[100], name_buf[100];
+        strcpy(dir_buf, room);
+        strcpy(name_buf, room);
+        snprintf(server_path, sizeof(server_path), "%s/%s", dirname(dir_buf), entry);
+        snprintf(reg_msg, sizeof(reg_msg), "%s:%s:%s%s\n", username, uuid_str,
+                 basename(name_buf), replay);
+    }
 
+    sem_init(&joined, 0, 0);
     pthread_t t;
-    pthread_create(&t, NULL, reader, NULL);
-    pthread_detach(t);
+    int out_fd = -1;
+
+    if (use_socket) {
+        // The registration is the first packet on the connection.
+        in_fd = connect_socket(server_path);
+        if (in_fd == -1) {
+            printf("Cannot connect to server.\n");
+            return 1;
+        }
+        out_fd = in_fd;
+        pthread_create(&t, NULL, reader, NULL);
+        send(in_fd, reg_msg, strlen(reg_msg), MSG_NOSIGNAL);
+    } else {
+        snprintf(client_fifo, sizeof(client_fifo), "%s/%s_client_fifo", room, uuid_str);
+        snprintf(server_fifo, sizeof(server_fifo), "%s/%s_server_fifo", room, uuid_str);
+
+        // Our FIFOs exist before the server hears about us, so joining
+        // costs one round trip.  Fresh ones are made even when rejoining,
+        // so an old session still running under this UUID keeps its own.
+        // The room directory is normally created by the server on the
+        // first join.
+        mkdir(room, 0777);
+        unlink(client_fifo);
+        unlink(server_fifo);
+        if (mkfifo(client_fifo, 0666) == -1 || mkfifo(server_fifo, 0666) == -1) {
+            perror("mkfifo");
+            return 1;
+        }
 
-    char msg[256];
+        // Reads see nothing, not EOF, until the server opens its end.
+        in_fd = open(server_fifo, O_RDONLY | O_NONBLOCK);
+        if (in_fd == -1) {
+            perror(server_fifo);
+            return 1;
+        }
+        pthread_create(&t, NULL, reader, NULL);
+
+        int main_fd = open(server_path, O_WRONLY | O_NONBLOCK);
+        if (main_fd == -1) {
+            printf("Cannot connect to server.\n");
+            unlink(client_fifo);
+            unlink(server_fifo);
+            return 1;
+        }
+        write(main_fd, reg_msg, strlen(reg_msg));
+        close(main_fd);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += JOIN_TIMEOUT;
+    while (sem_timedwait(&joined, &deadline) == -1) {
+        if (errno == EINTR) continue;
+        printf("Server did not answer.\n");
+        if (!use_socket) {
+            unlink(client_fifo);
+            unlink(server_fifo);
+        }
+        return 1;
+    }
+
+    // The server holds its end open for the whole session, so this does
+    // not block.
+    if (!use_socket) {
+        out_fd = open(client_fifo, O_WRONLY);
+        if (out_fd == -1) {
+            perror(client_fifo);
+            return 1;
+        }
+    }
+
+    char *msg = NULL;
+    size_t msg_cap = 0;
+    uint64_t seq = 0;
     while (1) {
-        fgets(msg, sizeof(msg), stdin);
-        msg[strcspn(msg, "\n")] = '\0';
+        ssize_t len = getline(&msg, &msg_cap, stdin);
+        int closing = len == -1;
+        if (!closing) {
+            msg[strcspn(msg, "\n")] = '\0';
+            len = strlen(msg);
+            closing = strcmp(msg, "close") == 0;
+        }
 
-        int fd = open(client_fifo, O_WRONLY);
-        if (fd != -1) {
-            write(fd, msg, strlen(msg));
-            close(fd);
+        int rc;
+        if (closing) {
+            struct frame_header h;
+            frame_init(&h, FRAME_CLOSE, ++seq, NULL, NULL, 0);
+            atomic_store(&leaving, 1);
+            rc = frame_send(out_fd, &h, NULL);
+        } else {
+            rc = send_line(out_fd, msg, len, ++seq);
+        }
+        if (rc == -1) {
+            perror("write");
+            break;
         }
 
-        if (strcmp(msg, "close") == 0)
+        if (closing) {
+            // The server tears the session down as soon as it reads the
+            // close: frames still queued for us are dropped, and the
+            // reader stops at the EOF that follows.  --since with the
+            // last sequence number printed below fetches what was missed.
+            pthread_join(t, NULL);
             break;
+        }
     }
 
+    free(msg);
+    if (!use_socket) close(out_fd);
+    printf("[SYSTEM] to catch up later: ./client --uuid %s --since %" PRIu64 " %s %s\n",
+           uuid_str, atomic_load(&last_seq), username, room);
     return 0;
 }
 
+int connect_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A line longer than one frame goes over the socket as a sealed memfd,
+// which every socket member receives as is.  FIFOs can only carry its
+// first FRAME_MAX_PAYLOAD bytes.
+int send_line(int fd, const char *msg, size_t len, uint64_t seq)
+{
+    struct frame_header h;
+
+    if (!use_socket || len <= FRAME_MAX_PAYLOAD) {
+        if (len > FRAME_MAX_PAYLOAD) len = FRAME_MAX_PAYLOAD;
+        frame_init(&h, FRAME_MSG, seq, NULL, NULL, len);
+        return frame_send(fd, &h, msg);
+    }
+
+    int memfd = memfd_create("chat-message", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1) return -1;
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(memfd, msg + done, len - done);
+        if (n <= 0) {
+            close(memfd);
+            return -1;
+        }
+        done += n;
+    }
+    fcntl(memfd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    uint64_t size = len;
+    frame_init(&h, FRAME_MSG, seq, NULL, NULL, sizeof(size));
+    h.flags |= FRAME_F_MEMFD;
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { &size, sizeof(size) },
+    };
+
+    // The packet holds its own reference to the memfd while in flight.
+    ssize_t n = frame_send_fd(fd, iov, 2, memfd);
+    close(memfd);
+    return n == -1 ? -1 : 0;
+}
+
+void print_frame(const struct frame_header *h, const char *payload)
+{
+    size_t len = h->len;
+    char *mapped = NULL;
+
+    // The text of a large message is in the memfd that came with it.
+    if (h->type == FRAME_MSG && (h->flags & FRAME_F_MEMFD)) {
+        uint64_t size = 0;
+        if (passed_fd == -1 || h->len < sizeof(size)) return;
+        memcpy(&size, payload, sizeof(size));
+
+        if (size > 0)
+            mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, passed_fd, 0);
+        close(passed_fd);
+        passed_fd = -1;
+        if (mapped == MAP_FAILED) return;
+
+        payload = mapped;
+        len = size;
+    }
+
+    // Broadcasts come through the ring from the position in the welcome.
+    if (h->type == FRAME_SYSTEM && (h->flags & FRAME_F_RING) && !ring_attached) {
+        char ring_path[128];
+        snprintf(ring_path, sizeof(ring_path), "%s/ring", room);
+
+        if (ring_attach(&ring, ring_path) == 0) {
+            pthread_t t;
+            ring.cursor = h->seq;
+            ring_attached = 1;
+            pthread_create(&t, NULL, ring_reader, NULL);
+            pthread_detach(t);
+        } else {
+            printf("[SYSTEM] cannot open %s\n", ring_path);
+        }
+    }
+
+    if (h->type == FRAME_SYSTEM && (h->flags & FRAME_F_JOINED))
+        sem_post(&joined);
+
+    if (h->type == FRAME_MSG && h->seq > atomic_load(&last_seq))
+        atomic_store(&last_seq, h->seq);
+
+    if (h->type == FRAME_SYSTEM)
+        printf("[SYSTEM] %.*s\n", (int)len, payload);
+    else if (strcmp(h->uuid, uuid_str) == 0)
+        printf("You: %.*s\n", (int)len, payload);
+    else
+        printf("%s: %.*s\n", h->name, (int)len, payload);
+    fflush(stdout);
+
+    if (mapped) munmap(mapped, len);
+}
+
+// Blocks in poll until the server writes; every frame is printed as soon
+// as it arrives.
 void *reader(void *arg)
 {
-    char buffer[300];
+    static FrameReader in;
+    struct frame_header h;
+    const char *payload;
+    struct pollfd pfd = { .fd = in_fd, .events = POLLIN };
+    int passed = -1;
 
     while (1) {
-        int fd = open(server_fifo, O_RDONLY);
-        if (fd == -1) { usleep(SLEEP_TIME); continue; }
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(1);
+        }
 
-        int n = read(fd, buffer, sizeof(buffer) - 1);
-        close(fd);
+        ssize_t n;
+        while ((n = use_socket ? frame_recv(&in, in_fd, &passed)
+                               : frame_fill(&in, in_fd)) > 0) {
+            if (passed != -1) {
+                if (passed_fd != -1) close(passed_fd);
+                passed_fd = passed;
+            }
 
-        if (n > 0) {
-            buffer[n] = '\0';
-            printf("%s", buffer);
+            int rc;
+            while ((rc = frame_next(&in, &h, &payload)) == 1)
+                print_frame(&h, payload);
+
+            if (rc == -1) {
+                printf("[SYSTEM] corrupt data from server\n");
+                exit(1);
+            }
+        }
+
+        // EOF: the server closed the session, either because we asked to
+        // leave or because it dropped us.
+        if (n == 0) {
+            if (atomic_load(&leaving)) return NULL;
+            printf("[SYSTEM] disconnected by the server\n");
+            exit(0);
+        }
+    }
+}
+
+// Broadcasts in --shm mode; the FIFO reader still gets the welcome line.
+void *ring_reader(void *arg)
+{
+    static uint64_t buf[RING_MAX_RECORD / 8];
+    struct ring_record *rec = (struct ring_record *)buf;
+
+    while (1) {
+        if (!ring_next(&ring, rec)) {
+            printf("[SYSTEM] some messages were missed\n");
             fflush(stdout);
+            continue;
         }
 
-        usleep(SLEEP_TIME);
+        print_frame(&rec->frame, rec->payload);
     }
 }
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+static Segment *segment_open(const char *dir, uint64_t base, int create);
+static void segment_scan(Segment *s);
+static int index_add(Segment *s, uint64_t seq, uint64_t off, int persist);
+static void segment_remove(Segment *s);
+static void history_link(History *h, Segment *s);
+static int compare_base(const void *a, const void *b);
+
+
+
+int64_t history_open(History *h, const char *room_dir)
+{
+    memset(h, 0, sizeof(*h));
+    snprintf(h->dir, sizeof(h->dir), "%s/history", room_dir);
+    if (mkdir(h->dir, 0777) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    DIR *d = opendir(h->dir);
+    if (!d) {
+        perror("opendir");
+        return -1;
+    }
+
+    uint64_t *bases = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        uint64_t base;
+        char suffix[8];
+        if (sscanf(e->d_name, "%" SCNu64 ".%7s", &base, suffix) != 2) continue;
+        if (strcmp(suffix, "log") != 0) continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(bases, cap * sizeof(*bases));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                break;
+            }
+            bases = grown;
+        }
+        bases[n++] = base;
+    }
+    closedir(d);
+
+    qsort(bases, n, sizeof(*bases), compare_base);
+
+    // Keep only the newest HISTORY_SEGMENTS; anything older is stale.
+    for (size_t i = 0; i < n; i++) {
+        Segment *s = segment_open(h->dir, bases[i], 0);
+        if (!s) continue;
+
+        int stale = i + HISTORY_SEGMENTS < n;
+        if (!stale) {
+            segment_scan(s);
+            stale = s->count == 0;
+        }
+        if (stale) segment_remove(s);
+        else history_link(h, s);
+    }
+    free(bases);
+
+    return h->tail ? (int64_t)h->tail->last : 0;
+}
+
+
+
+int history_append(History *h, const struct frame_header *hdr, const void *payload)
+{
+    size_t need = sizeof(*hdr) + hdr->len;
+    Segment *s = h->tail;
+
+    if (!s || s->tail + need > HISTORY_SEGMENT_SIZE) {
+        s = segment_open(h->dir, hdr->seq, 1);
+        if (!s) return -1;
+        history_link(h, s);
+
+        if (h->nsegs > HISTORY_SEGMENTS) {
+            Segment *old = h->head;
+            h->head = old->next;
+            h->nsegs--;
+            segment_remove(old);
+        }
+    }
+
+    if (s->count % HISTORY_INDEX_EVERY == 0)
+        index_add(s, hdr->seq, s->tail, 1);
+
+    memcpy(s->map + s->tail, hdr, sizeof(*hdr));
+    memcpy(s->map + s->tail + sizeof(*hdr), payload, hdr->len);
+    s->tail += need;
+    s->last = hdr->seq;
+    s->count++;
+    return 0;
+}
+
+
+
+void history_replay(History *h, uint64_t since,
+                    void (*fn)(void *arg, Segment *seg, const char *data, size_t len),
+                    void *arg)
+{
+    for (Segment *s = h->head; s; s = s->next) {
+        if (s->count == 0 || s->last <= since) continue;
+
+        size_t off = 0;
+        if (s->base <= since) {
+            // Last indexed frame at or before since, then walk forward.
+            size_t lo = 0, hi = s->nindex;
+            while (hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+                if (s->index[mid].seq <= since) lo = mid;
+                else hi = mid;
+            }
+            if (s->nindex > 0) off = s->index[lo].off;
+
+            while (off < s->tail) {
+                const struct frame_header *f = (const struct frame_header *)(s->map + off);
+                if (f->seq > since) break;
+                off += sizeof(*f) + f->len;
+            }
+        }
+
+        if (off < s->tail) {
+            atomic_fetch_add(&s->refs, 1);
+            fn(arg, s, s->map + off, s->tail - off);
+        }
+    }
+}
+
+
+
+void segment_put(Segment *s)
+{
+    if (atomic_fetch_sub(&s->refs, 1) != 1) return;
+
+    munmap(s->map, HISTORY_SEGMENT_SIZE);
+    if (s->idx_fd != -1) close(s->idx_fd);
+    free(s->index);
+    free(s);
+}
+
+
+
+static Segment *segment_open(const char *dir, uint64_t base, int create)
+{
+    Segment *s = calloc(1, sizeof(Segment));
+    if (!s) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    atomic_init(&s->refs, 1);
+    s->base = base;
+    s->idx_fd = -1;
+    snprintf(s->path, sizeof(s->path), "%s/%020" PRIu64, dir, base);
+
+    char path[320];
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+
+    snprintf(path, sizeof(path), "%s.log", s->path);
+    int fd = open(path, flags, 0666);
+    if (fd == -1) {
+        perror("open");
+        free(s);
+        return NULL;
+    }
+
+    // Preallocated and zero-filled, so the end of the log needs no marker.
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size != HISTORY_SEGMENT_SIZE && ftruncate(fd, HISTORY_SEGMENT_SIZE) == -1)) {
+        perror("ftruncate");
+        close(fd);
+        free(s);
+        return NULL;
+    }
+
+    s->map = mmap(NULL, HISTORY_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        perror("mmap");
+        free(s);
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s.idx", s->path);
+    s->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (create ? O_TRUNC : 0), 0666);
+    if (s->idx_fd == -1) {
+        perror("open");
+        segment_put(s);
+        return NULL;
+    }
+    return s;
+}
+
+
+
+// Rebuild the in-memory state of a segment found on disk: load its index,
+// then walk the frames after the last indexed one to find the end.
+static void segment_scan(Segment *s)
+{
+    IndexEntry e;
+    while (read(s->idx_fd, &e, sizeof(e)) == sizeof(e)) {
+        if (e.off >= HISTORY_SEGMENT_SIZE) break;
+        if (index_add(s, e.seq, e.off, 0) == -1) break;
+    }
+
+    size_t off = s->nindex ? s->index[s->nindex - 1].off : 0;
+    s->count = s->nindex ? (s->nindex - 1) * HISTORY_INDEX_EVERY : 0;
+
+    while (off + sizeof(struct frame_header) <= HISTORY_SEGMENT_SIZE) {
+        const struct frame_header *f = (const struct frame_header *)(s->map + off);
+        if (f->type == 0 || f->len > FRAME_MAX_PAYLOAD) break;
+        if (off + sizeof(*f) + f->len > HISTORY_SEGMENT_SIZE) break;
+
+        off += sizeof(*f) + f->len;
+        s->last = f->seq;
+        s->count++;
+    }
+    s->tail = off;
+
+    // Index entries past the end are left over from a torn write.
+    while (s->nindex > 0 && s->index[s->nindex - 1].off >= s->tail) s->nindex--;
+}
+
+
+
+static int index_add(Segment *s, uint64_t seq, uint64_t off, int persist)
+{
+    if (s->nindex == s->index_cap) {
+        size_t cap = s->index_cap ? s->index_cap * 2 : 64;
+        IndexEntry *grown = realloc(s->index, cap * sizeof(IndexEntry));
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        s->index = grown;
+        s->index_cap = cap;
+    }
+
+    IndexEntry e = { seq, off };
+    s->index[s->nindex++] = e;
+    if (persist && write(s->idx_fd, &e, sizeof(e)) != sizeof(e))
+        perror("write");
+    return 0;
+}
+
+
+
+// Delete the files and drop the history's reference.  Replayed ranges
+// still queued for clients keep the mapping alive until they are sent.
+static void segment_remove(Segment *s)
+{
+    char path[320];
+    snprintf(path, sizeof(path), "%s.log", s->path);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.idx", s->path);
+    unlink(path);
+    segment_put(s);
+}
+
+
+
+static void history_link(History *h, Segment *s)
+{
+    if (h->tail) h->tail->next = s;
+    else h->head = s;
+    h->tail = s;
+    h->nsegs++;
+}
+
+
+
+static int compare_base(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
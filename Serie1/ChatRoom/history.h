@@ -0,0 +1,72 @@
+// Per-room message history: an append-only log of wire frames split into
+// fixed-size mmap'ed segments under <room>/history.
+//
+//   <base>.log   frames back to back, exactly as sent to clients; the
+//                zero-filled rest of the file marks the end
+//   <base>.idx   sparse index, one (seq, offset) entry every
+//                HISTORY_INDEX_EVERY frames
+//
+// <base> is the sequence number of the segment's first frame.  Appending
+// is a memcpy into the mapping, plus one small write(2) to the index every
+// HISTORY_INDEX_EVERY frames.  Replay hands out byte ranges of the
+// mappings, so history is streamed to clients without being copied.
+//
+// A History belongs to one thread (its room's shard).  Segments are
+// refcounted because replayed ranges may still be waiting in client
+// queues when an old segment is retired.
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+
+#define HISTORY_SEGMENT_SIZE (4u << 20)
+#define HISTORY_INDEX_EVERY 64
+#define HISTORY_SEGMENTS 16             // segments kept per room
+
+typedef struct {
+    uint64_t seq;
+    uint64_t off;
+} IndexEntry;
+
+typedef struct Segment {
+    atomic_int refs;
+    uint64_t base;              // seq of the first frame
+    uint64_t last;              // seq of the last frame, 0 while empty
+    uint64_t count;             // frames in the segment
+    char *map;
+    size_t tail;                // bytes in use
+    IndexEntry *index;
+    size_t nindex;
+    size_t index_cap;
+    int idx_fd;
+    char path[300];             // without the .log/.idx suffix
+    struct Segment *next;
+} Segment;
+
+typedef struct {
+    char dir[300];
+    Segment *head;              // oldest
+    Segment *tail;              // being appended to
+    size_t nsegs;
+} History;
+
+// Open <room_dir>/history, creating it if needed.  Returns the sequence
+// number of the newest frame on disk (0 for an empty history), or -1.
+int64_t history_open(History *h, const char *room_dir);
+
+int history_append(History *h, const struct frame_header *hdr, const void *payload);
+
+// Call fn for every contiguous range of frames with seq > since, oldest
+// first.  fn receives a reference to the segment and must drop it with
+// segment_put when the range is no longer needed.
+void history_replay(History *h, uint64_t since,
+                    void (*fn)(void *arg, Segment *seg, const char *data, size_t len),
+                    void *arg);
+
+void segment_put(Segment *s);
+
+#endif
@@ -0,0 +1,214 @@
+// Wire format shared by server and client.
+//
+// Every message on a client or server FIFO is one frame: a fixed header
+// followed by len bytes of payload.  Frames are only ever exchanged
+// between processes on the same host, so fields are in host byte order.
+//
+// Client -> server: seq is the sender's own counter; sender fields are
+// ignored and filled in by the server.
+//
+// Joining: the client creates <room>/<uuid>_client_fifo and
+// <room>/<uuid>_server_fifo, opens the latter for reading, and only then
+// writes its registration to main_fifo.  The first frame the server sends
+// is the welcome, flagged FRAME_F_JOINED; that is the acknowledgement.
+//
+// Socket transport (<root>/chat.sock, SOCK_SEQPACKET): the client's first
+// packet is its registration, every later packet holds whole frames one
+// way and a slice of the frame stream the other, so the same FrameReader
+// works for both transports.  A FRAME_F_MEMFD frame always travels alone
+// in its packet, together with the memfd as SCM_RIGHTS.
+//
+// Server -> client: seq is the room's sequence number for FRAME_MSG and
+// 0 for anything addressed to a single client.  The exception is a welcome
+// with FRAME_F_RING set, whose seq is the position in <room>/ring where
+// the client starts reading broadcasts.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#define FRAME_MAX_PAYLOAD 16384
+
+enum {
+    FRAME_MSG = 1,      // chat line
+    FRAME_SYSTEM = 2,   // server notice for one client
+    FRAME_CLOSE = 3,    // client is leaving
+};
+
+enum {
+    FRAME_F_RING = 1,   // broadcasts for this room go through <room>/ring
+    FRAME_F_JOINED = 2, // welcome: the server has set the client up
+    FRAME_F_MEMFD = 4,  // payload is a uint64_t size; the text is in a
+                        // sealed memfd passed along with the frame
+};
+
+struct frame_header {
+    uint32_t len;           // payload bytes
+    uint16_t type;
+    uint16_t flags;
+    uint64_t seq;
+    char uuid[40];          // sender id
+    char name[56];          // sender display name
+};
+
+#define FRAME_MAX (sizeof(struct frame_header) + FRAME_MAX_PAYLOAD)
+
+static inline void frame_init(struct frame_header *h, int type, uint64_t seq,
+                              const char *uuid, const char *name, size_t len)
+{
+    memset(h, 0, sizeof(*h));
+    h->len = len;
+    h->type = type;
+    h->seq = seq;
+    if (uuid) snprintf(h->uuid, sizeof(h->uuid), "%s", uuid);
+    if (name) snprintf(h->name, sizeof(h->name), "%s", name);
+}
+
+// Write one frame with a single writev, retrying short writes.
+static inline int frame_send(int fd, const struct frame_header *h, const void *payload)
+{
+    struct iovec iov[2] = {
+        { (void *)h, sizeof(*h) },
+        { (void *)payload, h->len },
+    };
+    int cnt = h->len ? 2 : 1;
+    struct iovec *v = iov;
+
+    while (cnt > 0) {
+        ssize_t n = writev(fd, v, cnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// One sendmsg carrying passed_fd with the data.  Only used on sockets,
+// where the packet is either sent whole or not at all.
+static inline ssize_t frame_send_fd(int fd, struct iovec *iov, int cnt, int passed_fd)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = cnt,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &passed_fd, sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    return n;
+}
+
+// Reassembles frames from a byte stream.  One read may return several
+// frames or only part of one; nothing is lost or merged either way.
+typedef struct {
+    size_t len;
+    size_t start;
+    union {
+        struct frame_header align;
+        char buf[2 * FRAME_MAX];
+    };
+} FrameReader;
+
+// Read whatever is available.  Returns the read(2) result: >0 bytes,
+// 0 on EOF, -1 with errno set (EAGAIN when a non-blocking fd is drained).
+static inline ssize_t frame_fill(FrameReader *r, int fd)
+{
+    if (r->start > 0 && r->len + FRAME_MAX > sizeof(r->buf)) {
+        memmove(r->buf, r->buf + r->start, r->len - r->start);
+        r->len -= r->start;
+        r->start = 0;
+    }
+
+    ssize_t n = read(fd, r->buf + r->len, sizeof(r->buf) - r->len);
+    if (n > 0) r->len += n;
+    return n;
+}
+
+// frame_fill for sockets: also returns a descriptor passed with the
+// packet in *passed_fd, or -1.  The buffer always has room for a whole
+// packet (at most FRAME_MAX bytes), so nothing is truncated.
+static inline ssize_t frame_recv(FrameReader *r, int fd, int *passed_fd)
+{
+    if (r->start > 0 && r->len + FRAME_MAX > sizeof(r->buf)) {
+        memmove(r->buf, r->buf + r->start, r->len - r->start);
+        r->len -= r->start;
+        r->start = 0;
+    }
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    struct iovec iov = { r->buf + r->len, sizeof(r->buf) - r->len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    *passed_fd = -1;
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return n;
+    r->len += n;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (*passed_fd == -1) *passed_fd = passed;
+            else close(passed);
+        }
+    }
+    return n;
+}
+
+// Next complete frame: returns 1 and points hdr/payload into the reader's
+// buffer (valid until the next frame_fill), 0 if more bytes are needed,
+// or -1 if the stream is corrupt.
+static inline int frame_next(FrameReader *r, struct frame_header *hdr, const char **payload)
+{
+    size_t avail = r->len - r->start;
+    if (avail < sizeof(*hdr)) return 0;
+
+    memcpy(hdr, r->buf + r->start, sizeof(*hdr));
+    if (hdr->len > FRAME_MAX_PAYLOAD) return -1;
+    if (avail < sizeof(*hdr) + hdr->len) return 0;
+
+    *payload = r->buf + r->start + sizeof(*hdr);
+    r->start += sizeof(*hdr) + hdr->len;
+    if (r->start == r->len) r->start = r->len = 0;
+    return 1;
+}
+
+#endif
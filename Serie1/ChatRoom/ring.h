@@ -0,0 +1,207 @@
+// Shared-memory broadcast ring used by the --shm transport.
+//
+// The server maps <room>/ring and is the only writer: every message is
+// copied into the ring once, no matter how many members the room has.
+// Each client maps the same file and follows the ring with its own cursor;
+// the only thing a reader ever writes is the header's waiter count.
+// Readers that are idle sleep on a futex in the header instead of
+// polling; the writer only issues FUTEX_WAKE when someone is actually
+// waiting.
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "protocol.h"
+
+#define RING_MAGIC 0x474e4952u          // "RING"
+#define RING_DATA_SIZE (1u << 20)       // must be a power of two
+
+enum { RING_MSG = 1, RING_PAD = 2 };
+
+struct ring_header {
+    uint32_t magic;
+    uint32_t size;
+    _Atomic uint64_t head;              // total bytes ever published
+    _Atomic uint32_t futex;             // bumped on every publish
+    _Atomic uint32_t waiters;           // readers blocked in FUTEX_WAIT
+};
+
+// Each record carries one wire frame, exactly as it would have been
+// written to a client FIFO.
+struct ring_record {
+    uint32_t len;                       // whole record, 8-byte aligned
+    uint32_t type;
+    struct frame_header frame;
+    char payload[];
+};
+
+#define RING_ALIGN(n) (((n) + 7u) & ~7u)
+#define RING_MAX_RECORD RING_ALIGN(sizeof(struct ring_record) + FRAME_MAX_PAYLOAD)
+
+// Bytes the writer may touch past the published head: a tail pad (always
+// shorter than the record that caused it) plus the record itself.
+#define RING_SLACK (2 * RING_MAX_RECORD)
+
+typedef struct {
+    struct ring_header *hdr;
+    char *data;
+    uint64_t cursor;                    // reader position, unused by the writer
+} Ring;
+
+static inline long ring_futex(_Atomic uint32_t *addr, int op, uint32_t val)
+{
+    // The mapping is shared between processes, so no FUTEX_PRIVATE_FLAG.
+    return syscall(SYS_futex, (uint32_t *)addr, op, val, NULL, NULL, 0);
+}
+
+static inline size_t ring_map_size(void)
+{
+    return sizeof(struct ring_header) + RING_DATA_SIZE;
+}
+
+// Server side: (re)create the ring file and map it read-write.
+static inline int ring_create(Ring *r, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) return -1;
+
+    if (ftruncate(fd, ring_map_size()) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, ring_map_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+
+    r->hdr = p;
+    r->data = (char *)p + sizeof(struct ring_header);
+    r->cursor = 0;
+    r->hdr->size = RING_DATA_SIZE;
+    atomic_store(&r->hdr->head, 0);
+    atomic_store(&r->hdr->futex, 0);
+    atomic_store(&r->hdr->waiters, 0);
+    atomic_thread_fence(memory_order_release);
+    r->hdr->magic = RING_MAGIC;
+    return 0;
+}
+
+// Client side: map an existing ring and start at its current head, so a
+// new member only sees messages published after it joined.
+static inline int ring_attach(Ring *r, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    void *p = mmap(NULL, ring_map_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+
+    r->hdr = p;
+    r->data = (char *)p + sizeof(struct ring_header);
+    if (r->hdr->magic != RING_MAGIC || r->hdr->size != RING_DATA_SIZE) {
+        munmap(p, ring_map_size());
+        return -1;
+    }
+    r->cursor = atomic_load(&r->hdr->head);
+    return 0;
+}
+
+static inline void ring_detach(Ring *r)
+{
+    munmap(r->hdr, ring_map_size());
+}
+
+// Single writer only.
+static inline void ring_publish(Ring *r, const struct frame_header *h, const void *payload)
+{
+    uint32_t need = RING_ALIGN(sizeof(struct ring_record) + h->len);
+    uint64_t pos = atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+    uint32_t off = pos & (RING_DATA_SIZE - 1);
+
+    if (off + need > RING_DATA_SIZE) {
+        // Not enough room before the end: pad out the tail and wrap.
+        struct ring_record *pad = (struct ring_record *)(r->data + off);
+        pad->len = RING_DATA_SIZE - off;
+        pad->type = RING_PAD;
+        pos += pad->len;
+        off = 0;
+    }
+
+    struct ring_record *rec = (struct ring_record *)(r->data + off);
+    rec->len = need;
+    rec->type = RING_MSG;
+    rec->frame = *h;
+    memcpy(rec->payload, payload, h->len);
+
+    atomic_store_explicit(&r->hdr->head, pos + need, memory_order_release);
+    atomic_fetch_add(&r->hdr->futex, 1);
+    if (atomic_load(&r->hdr->waiters) > 0)
+        ring_futex(&r->hdr->futex, FUTEX_WAKE, INT_MAX);
+}
+
+// Copy the next message into out (at least RING_MAX_RECORD bytes) without
+// blocking.  Returns 1 on success, -1 if nothing new has been published,
+// or 0 if the writer lapped this reader; the cursor is then moved to the
+// head and the skipped messages are lost.
+static inline int ring_poll(Ring *r, struct ring_record *out)
+{
+    while (1) {
+        uint64_t head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+        if (head == r->cursor) return -1;
+
+        if (head + RING_SLACK - r->cursor > RING_DATA_SIZE) {
+            r->cursor = head;
+            return 0;
+        }
+
+        uint32_t off = r->cursor & (RING_DATA_SIZE - 1);
+        const struct ring_record *rec = (const struct ring_record *)(r->data + off);
+        uint32_t len = rec->len;
+        uint32_t type = rec->type;
+        if (len < 8 || len > RING_MAX_RECORD) len = RING_MAX_RECORD;
+        if (type == RING_MSG)
+            memcpy(out, rec, len);
+
+        // The writer may have wrapped onto this record while we copied it.
+        atomic_thread_fence(memory_order_acquire);
+        head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+        if (head + RING_SLACK - r->cursor > RING_DATA_SIZE) {
+            r->cursor = head;
+            return 0;
+        }
+
+        r->cursor += len;
+        if (type != RING_MSG) continue;
+
+        if (out->frame.len > len - sizeof(struct ring_record))
+            out->frame.len = len - sizeof(struct ring_record);
+        return 1;
+    }
+}
+
+// Like ring_poll, but blocks until a message is published.
+static inline int ring_next(Ring *r, struct ring_record *out)
+{
+    while (1) {
+        // Read the futex word first so a publish in between is not missed.
+        uint32_t seq = atomic_load(&r->hdr->futex);
+        int rc = ring_poll(r, out);
+        if (rc != -1) return rc;
+
+        atomic_fetch_add(&r->hdr->waiters, 1);
+        ring_futex(&r->hdr->futex, FUTEX_WAIT, seq);
+        atomic_fetch_sub(&r->hdr->waiters, 1);
+    }
+}
+
+#endif
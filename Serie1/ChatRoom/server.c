@@ -1,171 +1,1638 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 
-#define MAX_CLIENTS 10
-#define BUF_SIZE 256
-#define SLEEP_TIME 100000
+#include "protocol.h"
+#include "ring.h"
+#include "history.h"
+#include "stats.h"
 
+#define MAX_EVENTS 64
+#define IOV_BATCH 64
+#define SOCK_CHUNK FRAME_MAX    // bytes per packet to a socket client
+
+// One encoded frame.  A broadcast builds it once and every recipient's
+// queue holds a reference to the same buffer.  A history replay is a run
+// of frames pointing straight into a mapped log segment instead.
 typedef struct {
+    atomic_int refs;
+    size_t len;
+    const char *data;       // buf, or inside seg
+    Segment *seg;
+    uint64_t born;          // when a broadcast arrived, 0 for anything else
+    int fd;                 // memfd passed along (socket clients), or -1
+    char buf[];
+} Msg;
+
+// Frames waiting to be written to one client, oldest first.  Bounded by
+// queue_limit; what happens when it is full is set by queue_policy.
+typedef struct {
+    Msg **items;
+    size_t head;
+    size_t count;
+    size_t off;             // bytes of items[head] already written
+} OutQueue;
+
+typedef struct Room Room;
+typedef struct Shard Shard;
+
+typedef struct Client {
+    Room *room;
     char name[50];
     char uuid[40];
-    char client_fifo[128];
-    char server_fifo[128];
+    char client_fifo[320];
+    char server_fifo[320];
+    int in_fd;      // client -> server, kept open for the whole session
+    int out_fd;     // server -> client, kept open for the whole session
+    FrameReader *in;
+    int is_socket;          // in_fd is the connection, out_fd a dup of it
+    int passed_fd;          // memfd received ahead of its frame, or -1
+
+    // Outbound side, shared with the writer pool; guarded by lock
+    pthread_mutex_t lock;
+    OutQueue out;
+    int gone;               // left the room; nothing more is sent
+    int queued;             // on the ready list for a writer
+    int blocked;            // FIFO full, out_fd armed for EPOLLOUT
+    int registered;         // out_fd has been added to the shard's epfd
+    int evicting;           // disconnect requested
+    uint64_t dropped;       // frames lost to the queue policy
+    uint64_t failures;      // failed writes
+    struct stats_client *row;
+    struct Client *next_ready;
+    struct Client *next_evict;
+
+    int dirty;              // on the shard's dirty list (shard thread only)
+    struct Client *next_dirty;
+    atomic_int refs;
+    struct Client *hnext;   // registry hash chain
+    size_t slot;            // index in registry.members
 } Client;
 
-Client clients[MAX_CLIENTS];
-int client_count = 0;
+// Room membership: a UUID hash map for lookups plus a dense member array
+// for broadcasts.  Both grow on demand; join and leave are O(1) amortised
+// (leave swaps the last member into the freed slot).  Broadcasts iterate
+// under the read lock, so they see a stable member set while joins and
+// leaves wait for the write lock.
+typedef struct {
+    pthread_rwlock_t lock;
+    Client **buckets;
+    size_t nbuckets;
+    Client **members;
+    size_t count;
+    size_t cap;
+} Registry;
+
+// A chat room: the root directory itself (registrations without a room
+// name) or <root>/<name>, created on its first join.  A room lives on one
+// shard for its whole life, so its sequence counter and ring are only
+// touched by that shard's thread.
+struct Room {
+    char name[64];          // "" for the root room
+    char dir[256];
+    Registry registry;
+    uint64_t seq;
+    int has_ring;
+    Ring ring;
+    int has_history;
+    History history;
+    Shard *shard;
+    struct Room *next;      // all rooms, main thread only
+};
+
+// What a joining client gets from the room's history before live traffic
+enum { REPLAY_DEFAULT, REPLAY_LAST, REPLAY_SINCE };
+
+// A join handed from the main thread to the shard that owns the room
+typedef struct Join {
+    Room *room;
+    char name[50];
+    char uuid[40];
+    int replay;
+    uint64_t replay_arg;    // message count for REPLAY_LAST, seq for REPLAY_SINCE
+    int sock;               // connection for socket clients, -1 for FIFOs
+    struct Join *next;
+} Join;
+
+// One event loop thread.  Rooms are spread over the shards and every
+// client is served by its room's shard only.
+struct Shard {
+    pthread_t thread;
+    int epfd;
+    int wake_fd;            // eventfd: joins or evictions are pending
+
+    // Clients with new frames in this epoll batch.  They are handed to the
+    // writer pool once the batch is done, so everything queued for one
+    // client goes out in a single writev.
+    Client *dirty_list;
+
+    // Handed in from other threads, guarded by lock
+    pthread_mutex_t lock;
+    Join *joins;
+    Client *evicts;         // only the shard may remove its clients
+
+    atomic_size_t members;
+    size_t rooms;           // main thread only
+};
+
+Shard *shards;
+int num_shards;
+
+Room *rooms = NULL;
+const char *root;
+
+// Tags for epoll_event.data.ptr that are not clients
+static char main_tag, wake_tag, listen_tag;
+
+// A socket connection that has not sent its registration yet
+typedef struct {
+    int fd;
+} Pending;
+
+// Client pointers tag their out_fd with the low bit set
+#define OUT_TAG(c) ((void *)((uintptr_t)(c) | 1))
 
-void send_message(const char *sender, const char *uuid, const char *msg);
-void send_online(const char *sender, const char *room);
-void *client_thread(void *arg);
-void *keyboard_thread(void *arg);
+// Slow consumers: per-client queue bound and what to do when it is full
+enum { DROP_OLDEST, DROP_NEWEST, DISCONNECT };
+const char *policy_names[] = { "drop-oldest", "drop-newest", "disconnect" };
+size_t queue_limit = 256;
+int queue_policy = DROP_OLDEST;
+int num_writers = 2;
 
+// Clients with frames to write, drained by the writer threads
+pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+Client *ready_head = NULL, *ready_tail = NULL;
 
+// --shm: broadcasts go through <room>/ring instead of one write per client
+int use_ring = 0;
+
+// --socket: also accept clients on <root>/chat.sock
+int use_socket = 0;
+
+// Rooms log their messages under <room>/history; joining clients that do
+// not ask for anything else get the last replay_default of them.
+int use_history = 1;
+uint64_t replay_default = 20;
+
+// <root>/stats; every thread writes only its own block
+struct stats_page *stats;
+static __thread struct stats_block *my_stats;
+static struct stats_client spare_row;   // clients beyond STATS_CLIENTS
+
+int registry_add(Registry *r, Client *c);
+Client *registry_remove(Registry *r, const char *uuid);
+int registry_remove_client(Registry *r, Client *c);
+size_t registry_count(Registry *r);
+void client_put(Client *c);
+
+Msg *msg_new(int type, uint64_t seq, const Client *from, const void *payload, size_t len);
+Msg *msg_history(Segment *seg, const char *data, size_t len);
+void msg_put(Msg *m);
+void enqueue(Client *c, Msg *m);
+void schedule_writes(Shard *sh);
+void push_ready(Client *c);
+void *writer_thread(void *arg);
+void write_client(Client *c);
+void request_evict(Client *c);
+
+void *shard_thread(void *arg);
+void handle_wake(Shard *sh);
+Room *find_room(const char *name);
+Room *create_room(const char *name);
+size_t total_members(void);
+
+void open_stats(void);
+struct stats_client *claim_stats_row(const Client *c);
+uint64_t now_ns(void);
+int open_fifo(const char *path);
+void accept_clients(int main_fd);
+Join *parse_join(char **pp);
+void queue_join(Join *j);
+int open_socket(const char *path);
+void accept_socket(int listen_fd, int epfd);
+void read_socket_join(Pending *pc, int epfd);
+void add_client(const Join *j);
+void leave_client(Client *c);
+void remove_client(Client *c);
+void send_message(Client *from, const char *msg, size_t len, int memfd);
+void send_large(Client *from, int memfd);
+void send_online(Client *c);
+void send_history(Client *c, int replay, uint64_t arg);
+void handle_client(Client *c);
+void handle_writable(Client *c);
+void handle_keyboard(void);
+void print_stats(void);
+
+
+
+static void usage(void)
+{
+    printf("Usage: ./server [--shm] [--socket] [--queue N] [--policy drop-oldest|drop-newest|disconnect]\n"
+           "                [--writers N] [--shards N] [--replay N | --no-history] <room>\n");
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        printf("Usage: ./server <room>\n");
+    static const struct option opts[] = {
+        { "shm",     no_argument,       NULL, 's' },
+        { "socket",  no_argument,       NULL, 'u' },
+        { "queue",   required_argument, NULL, 'q' },
+        { "policy",  required_argument, NULL, 'p' },
+        { "writers", required_argument, NULL, 'w' },
+        { "shards",  required_argument, NULL, 'S' },
+        { "replay",  required_argument, NULL, 'r' },
+        { "no-history", no_argument,    NULL, 'H' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            use_ring = 1;
+            break;
+        case 'u':
+            use_socket = 1;
+            break;
+        case 'q':
+            // A half-written frame is never dropped, so keep room for one more.
+            queue_limit = strtoul(optarg, NULL, 10);
+            if (queue_limit < 2) queue_limit = 2;
+            break;
+        case 'p':
+            queue_policy = -1;
+            for (int i = 0; i < 3; i++)
+                if (strcmp(optarg, policy_names[i]) == 0) queue_policy = i;
+            if (queue_policy == -1) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'w':
+            num_writers = atoi(optarg);
+            if (num_writers < 1) num_writers = 1;
+            break;
+        case 'S':
+            num_shards = atoi(optarg);
+            break;
+        case 'r':
+            replay_default = strtoull(optarg, NULL, 10);
+            break;
+        case 'H':
+            use_history = 0;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage();
         return 1;
     }
 
-    char *room = argv[1];
-    mkdir(room, 0777);
+    // Main thread, shards and writers each need a stats block.
+    if (num_shards < 1) num_shards = 1;
+    if (num_shards > STATS_BLOCKS / 2) num_shards = STATS_BLOCKS / 2;
+    if (num_writers > STATS_BLOCKS / 2 - 1) num_writers = STATS_BLOCKS / 2 - 1;
+
+    root = argv[optind];
+    mkdir(root, 0777);
 
     char main_fifo[128];
-    snprintf(main_fifo, sizeof(main_fifo), "%s/main_fifo", room);
+    snprintf(main_fifo, sizeof(main_fifo), "%s/main_fifo", root);
 
     mkfifo(main_fifo, 0666);
 
-    printf("Chatroom '%s' started. Type \"close\" when empty to exit.\n", room);
+    open_stats();
+    my_stats = &stats->blocks[0];
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    int main_fd = open_fifo(main_fifo);
+    if (main_fd == -1) {
+        perror(main_fifo);
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &main_tag };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, main_fd, &ev);
+
+    // Writes to a socket client that has hung up fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
 
-    pthread_t key;
-    pthread_create(&key, NULL, keyboard_thread, NULL);
-    pthread_detach(key);
+    int listen_fd = -1;
+    if (use_socket) {
+        char sock_path[300];
+        snprintf(sock_path, sizeof(sock_path), "%s/chat.sock", root);
+        listen_fd = open_socket(sock_path);
+        if (listen_fd == -1) {
+            perror(sock_path);
+            return 1;
+        }
+        ev.data.ptr = &listen_tag;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    }
 
+    // stdin cannot be watched when it is a regular file or /dev/null;
+    // in that case the server simply runs until killed.
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+
+    shards = calloc(num_shards, sizeof(Shard));
+    if (!shards) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        Shard *sh = &shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+        sh->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sh->epfd == -1 || sh->wake_fd == -1) {
+            perror("shard");
+            return 1;
+        }
+
+        ev.data.ptr = &wake_tag;
+        epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->wake_fd, &ev);
+        pthread_create(&sh->thread, NULL, shard_thread, sh);
+        pthread_detach(sh->thread);
+    }
+
+    for (int i = 0; i < num_writers; i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, writer_thread, &stats->blocks[1 + num_shards + i]);
+        pthread_detach(t);
+    }
+
+    printf("Chatroom '%s' started. Type \"close\" when empty to exit.\n", root);
+
+    // The main thread only takes registrations and console commands.
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        int fd = open(main_fifo, O_RDONLY);
-        if (fd == -1) continue;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return 1;
+        }
 
-        char buf[200];
-        int n = read(fd, buf, sizeof(buf) - 1);
-        if (n <= 0) {
-            close(fd);
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &main_tag)
+                accept_clients(main_fd);
+            else if (tag == &listen_tag)
+                accept_socket(listen_fd, epfd);
+            else if (tag)
+                read_socket_join(tag, epfd);
+            else
+                handle_keyboard();
+        }
+    }
+
+    return 0;
+}
+
+
+
+// The page lives in a file so that chatstat can map it while we run.  If
+// that fails the counters still go somewhere, just not anywhere visible.
+void open_stats(void)
+{
+    char path[300];
+    snprintf(path, sizeof(path), "%s/stats", root);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd != -1 && ftruncate(fd, sizeof(struct stats_page)) == 0) {
+        void *p = mmap(NULL, sizeof(struct stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) stats = p;
+    }
+    if (fd != -1) close(fd);
+
+    if (!stats) {
+        perror(path);
+        stats = calloc(1, sizeof(struct stats_page));
+        if (!stats) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    stats->started = time(NULL);
+    stats->pid = getpid();
+    stats->shards = num_shards;
+    stats->writers = num_writers;
+    stats->version = STATS_VERSION;
+    atomic_thread_fence(memory_order_release);
+    stats->magic = STATS_MAGIC;
+}
+
+// Rows are claimed lock-free, so joins on different shards never wait
+// for each other.
+struct stats_client *claim_stats_row(const Client *c)
+{
+    for (int i = 0; i < STATS_CLIENTS; i++) {
+        struct stats_client *row = &stats->client_rows[i];
+        int expected = 0;
+        if (atomic_load_explicit(&row->used, memory_order_relaxed) != 0 ||
+            !atomic_compare_exchange_strong(&row->used, &expected, 1))
             continue;
+
+        snprintf(row->name, sizeof(row->name), "%s", c->name);
+        snprintf(row->uuid, sizeof(row->uuid), "%s", c->uuid);
+        snprintf(row->room, sizeof(row->room), "%s", c->room->name);
+        atomic_store(&row->frames_out, 0);
+        atomic_store(&row->dropped, 0);
+        atomic_store(&row->failures, 0);
+        atomic_store(&row->queued, 0);
+        atomic_store(&row->used, 2);
+        return row;
+    }
+    return &spare_row;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Opening a FIFO O_RDWR never blocks and keeps a writer and a reader
+// attached, so the descriptor never reports EOF/HUP between clients and
+// writes are buffered even while the peer has the FIFO closed.
+int open_fifo(const char *path)
+{
+    return open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+void accept_clients(int main_fd)
+{
+    static char buf[1024];
+    static size_t kept = 0;
+    int n;
+
+    while ((n = read(main_fd, buf + kept, sizeof(buf) - 1 - kept)) > 0) {
+        size_t len = kept + n;
+        char *end = buf + len;
+        buf[len] = '\0';
+        kept = 0;
+
+        // Registrations are written whole, so only a read that fills the
+        // buffer can end inside one; keep anything after its last newline
+        // for the next read.
+        if (len == sizeof(buf) - 1) {
+            char *nl = memrchr(buf, '\n', len);
+            if (nl) {
+                end = nl + 1;
+                kept = len - (end - buf);
+            }
         }
-        buf[n] = '\0';
-        close(fd);
 
-        char username[50], uuid[40];
-        sscanf(buf, "%49[^:]:%39s", username, uuid);
+        char *p = buf;
+        while (p < end && *p) {
+            Join *j = parse_join(&p);
+            if (j) queue_join(j);
+        }
+
+        memmove(buf, end, kept);
+    }
+}
+
+// Several registrations may arrive in one read.  Each is
+// "username:uuid[:room[:last=N|:since=SEQ]]", optionally newline
+// terminated; the room is empty for the root room.  A UUID is always 36
+// characters, which splits unterminated registrations apart (those cannot
+// carry a room).  Parses the one at *pp and moves past it; returns NULL
+// if it is malformed or its room cannot be opened.
+Join *parse_join(char **pp)
+{
+    char username[50], uuid[40], name[64] = "";
+    int used = 0, replay = REPLAY_DEFAULT;
+    unsigned long long arg = 0;
+    char *p = *pp;
+
+    p += strspn(p, "\n");
+    if (sscanf(p, "%49[^:\n]:%36[0-9a-fA-F-]%n", username, uuid, &used) != 2) {
+        *pp = p + strcspn(p, "\n");
+        return NULL;
+    }
+    p += used;
+
+    if (*p == ':') {
+        used = 0;
+        sscanf(p, ":%63[^:\n]%n", name, &used);
+        p += used ? used : 1;
+    }
 
-        if (client_count >= MAX_CLIENTS) {
-            printf("Room full!\n");
+    if (*p == ':') {
+        if (sscanf(p, ":last=%llu", &arg) == 1)
+            replay = REPLAY_LAST;
+        else if (sscanf(p, ":since=%llu", &arg) == 1)
+            replay = REPLAY_SINCE;
+        p += strcspn(p, "\n");
+    }
+    *pp = p;
+
+    Room *room = find_room(name);
+    if (!room) room = create_room(name);
+    if (!room) {
+        printf("Cannot open room '%s'\n", name);
+        return NULL;
+    }
+
+    Join *j = calloc(1, sizeof(Join));
+    if (!j) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    j->room = room;
+    snprintf(j->name, sizeof(j->name), "%s", username);
+    snprintf(j->uuid, sizeof(j->uuid), "%s", uuid);
+    j->replay = replay;
+    j->replay_arg = arg;
+    j->sock = -1;
+    return j;
+}
+
+void queue_join(Join *j)
+{
+    Shard *sh = j->room->shard;
+    pthread_mutex_lock(&sh->lock);
+    j->next = sh->joins;
+    sh->joins = j;
+    pthread_mutex_unlock(&sh->lock);
+
+    uint64_t one = 1;
+    write(sh->wake_fd, &one, sizeof(one));
+}
+
+// SOCK_SEQPACKET keeps every frame in one piece and reports hangups,
+// which FIFOs do not.
+int open_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void accept_socket(int listen_fd, int epfd)
+{
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        Pending *pc = malloc(sizeof(Pending));
+        if (!pc) {
+            fprintf(stderr, "Out of memory\n");
+            close(fd);
             continue;
         }
+        pc->fd = fd;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = pc };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
 
-        Client *c = &clients[client_count++];
-        strcpy(c->name, username);
-        strcpy(c->uuid, uuid);
+// The first packet on a new connection is its registration.
+void read_socket_join(Pending *pc, int epfd)
+{
+    char buf[512];
+    ssize_t n = recv(pc->fd, buf, sizeof(buf) - 1, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, pc->fd, NULL);
+
+    Join *j = NULL;
+    if (n > 0) {
+        buf[n] = '\0';
+        char *p = buf;
+        j = parse_join(&p);
+    }
+
+    if (j) {
+        j->sock = pc->fd;
+        queue_join(j);
+    } else {
+        close(pc->fd);
+    }
+    free(pc);
+}
+
+// Shard thread of the room.
+void add_client(const Join *j)
+{
+    Room *room = j->room;
+    const char *username = j->name, *uuid = j->uuid;
 
-        snprintf(c->client_fifo, sizeof(c->client_fifo), "%s/%s_client_fifo", room, uuid);
-        snprintf(c->server_fifo, sizeof(c->server_fifo), "%s/%s_server_fifo", room, uuid);
+    // A UUID that is already a member is reconnecting: drop the old session.
+    Client *old = registry_remove(&room->registry, uuid);
+    if (old) {
+        // The new session has already created fresh FIFOs at the same
+        // paths; only the old session's descriptors go away.
+        old->client_fifo[0] = old->server_fifo[0] = '\0';
+        remove_client(old);
+        client_put(old);
+    }
 
+    Client *c = calloc(1, sizeof(Client));
+    if (!c) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+    atomic_init(&c->refs, 1);
+    pthread_mutex_init(&c->lock, NULL);
+    c->in = malloc(sizeof(FrameReader));
+    c->out.items = malloc(queue_limit * sizeof(Msg *));
+    if (!c->in || !c->out.items) {
+        fprintf(stderr, "Out of memory\n");
+        free(c->in);
+        free(c->out.items);
+        free(c);
+        return;
+    }
+    c->in->len = c->in->start = 0;
+    c->passed_fd = -1;
+    c->room = room;
+    snprintf(c->name, sizeof(c->name), "%s", username);
+    snprintf(c->uuid, sizeof(c->uuid), "%s", uuid);
+
+    if (j->sock != -1) {
+        // The write side gets its own descriptor so that it can be armed
+        // for EPOLLOUT in the same epoll set as the read side.
+        c->is_socket = 1;
+        c->in_fd = j->sock;
+        c->out_fd = dup(j->sock);
+    } else {
+        snprintf(c->client_fifo, sizeof(c->client_fifo), "%s/%s_client_fifo", room->dir, uuid);
+        snprintf(c->server_fifo, sizeof(c->server_fifo), "%s/%s_server_fifo", room->dir, uuid);
+
+        // Clients create their FIFOs before registering; this only matters
+        // for ones that do not.
         mkfifo(c->client_fifo, 0666);
         mkfifo(c->server_fifo, 0666);
 
-        for (int i = 0; i < 50; i++) {
-            int test = open(c->server_fifo, O_WRONLY | O_NONBLOCK);
-            if (test != -1) { close(test); break; }
-            usleep(SLEEP_TIME);
-        }
+        c->in_fd = open_fifo(c->client_fifo);
+        c->out_fd = open_fifo(c->server_fifo);
+    }
+    if (c->in_fd == -1 || c->out_fd == -1) {
+        perror("open client");
+        if (c->in_fd != -1) close(c->in_fd);
+        if (c->out_fd != -1) close(c->out_fd);
+        free(c->in);
+        free(c->out.items);
+        free(c);
+        return;
+    }
 
-        send_online(c->name, room);
+    if (registry_add(&room->registry, c) == -1) {
+        fprintf(stderr, "Out of memory\n");
+        close(c->in_fd);
+        close(c->out_fd);
+        free(c->in);
+        free(c->out.items);
+        free(c);
+        return;
+    }
 
-        time_t now = time(NULL);
-        printf("[%s] Client '%s' joined.\n", strtok(ctime(&now), "\n"), username);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(room->shard->epfd, EPOLL_CTL_ADD, c->in_fd, &ev);
+    atomic_fetch_add(&room->shard->members, 1);
+    atomic_fetch_add(&stats->clients, 1);
+    atomic_fetch_add(&stats->joins, 1);
+    c->row = claim_stats_row(c);
 
-        pthread_t t;
-        pthread_create(&t, NULL, client_thread, c);
-        pthread_detach(t);
+    send_online(c);
+    send_history(c, j->replay, j->replay_arg);
+
+    char now_buf[32];
+    time_t now = time(NULL);
+    ctime_r(&now, now_buf);
+    now_buf[strcspn(now_buf, "\n")] = '\0';
+    if (room->name[0])
+        printf("[%s] Client '%s' joined room '%s'.\n", now_buf, username, room->name);
+    else
+        printf("[%s] Client '%s' joined.\n", now_buf, username);
+}
+
+// Shard thread of the client's room.  A session that was already
+// replaced by a reconnect is gone; the UUID belongs to the new one.
+void leave_client(Client *c)
+{
+    if (c->gone)
+        return;
+    if (registry_remove_client(&c->room->registry, c)) {
+        remove_client(c);
+        client_put(c);
     }
+}
 
-    return 0;
+// Tear down a session that has already been taken out of the registry.
+void remove_client(Client *c)
+{
+    Shard *sh = c->room->shard;
+
+    epoll_ctl(sh->epfd, EPOLL_CTL_DEL, c->in_fd, NULL);
+    atomic_fetch_sub(&sh->members, 1);
+    atomic_fetch_sub(&stats->clients, 1);
+    atomic_fetch_add(&stats->leaves, 1);
+
+    pthread_mutex_lock(&c->lock);
+    c->gone = 1;
+    if (c->registered)
+        epoll_ctl(sh->epfd, EPOLL_CTL_DEL, c->out_fd, NULL);
+    int was_blocked = c->blocked;
+    c->blocked = 0;
+    pthread_mutex_unlock(&c->lock);
+    if (was_blocked) client_put(c);
+
+    if (c->client_fifo[0]) {
+        unlink(c->client_fifo);
+        unlink(c->server_fifo);
+    }
+
+    // Events for c may still be pending in this epoll batch; the dirty
+    // list's reference keeps it alive until the batch is finished.
+    if (!c->dirty) {
+        c->dirty = 1;
+        atomic_fetch_add(&c->refs, 1);
+        c->next_dirty = sh->dirty_list;
+        sh->dirty_list = c;
+    }
+
+    printf("Client '%s' left.\n", c->name);
+}
+
+void client_put(Client *c)
+{
+    if (atomic_fetch_sub(&c->refs, 1) == 1) {
+        OutQueue *q = &c->out;
+        for (size_t i = 0; i < q->count; i++)
+            msg_put(q->items[(q->head + i) % queue_limit]);
+        free(q->items);
+        if (c->row && c->row != &spare_row)
+            atomic_store(&c->row->used, 0);
+        pthread_mutex_destroy(&c->lock);
+        close(c->in_fd);
+        close(c->out_fd);
+        if (c->passed_fd != -1) close(c->passed_fd);
+        free(c->in);
+        free(c);
+    }
 }
 
 
 
-void send_online(const char *sender, const char *room)
+Msg *msg_new(int type, uint64_t seq, const Client *from, const void *payload, size_t len)
 {
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].name, sender) == 0) {
-            int fd = open(clients[i].server_fifo, O_WRONLY);
-            dprintf(fd, "[SYSTEM] Welcome %s to chat room %s! online users: %d\n",
-                    sender, room, client_count - 1);
-            close(fd);
+    Msg *m = malloc(sizeof(Msg) + sizeof(struct frame_header) + len);
+    if (!m) return NULL;
+
+    struct frame_header h;
+    frame_init(&h, type, seq, from ? from->uuid : NULL, from ? from->name : NULL, len);
+    memcpy(m->buf, &h, sizeof(h));
+    memcpy(m->buf + sizeof(h), payload, len);
+    m->data = m->buf;
+    m->seg = NULL;
+    m->born = 0;
+    m->fd = -1;
+    m->len = sizeof(h) + len;
+    atomic_init(&m->refs, 1);
+    return m;
+}
+
+// Takes over the caller's reference to seg.
+Msg *msg_history(Segment *seg, const char *data, size_t len)
+{
+    Msg *m = malloc(sizeof(Msg));
+    if (!m) {
+        segment_put(seg);
+        return NULL;
+    }
+
+    m->data = data;
+    m->seg = seg;
+    m->born = 0;
+    m->fd = -1;
+    m->len = len;
+    atomic_init(&m->refs, 1);
+    return m;
+}
+
+void msg_put(Msg *m)
+{
+    if (atomic_fetch_sub(&m->refs, 1) == 1) {
+        if (m->seg) segment_put(m->seg);
+        if (m->fd != -1) close(m->fd);
+        free(m);
+    }
+}
+
+// Shard thread of the client's room.
+void enqueue(Client *c, Msg *m)
+{
+    OutQueue *q = &c->out;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->gone || c->evicting) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+
+    if (q->count == queue_limit) {
+        c->dropped++;
+        stats_add(&my_stats->dropped, 1);
+        stats_add(&c->row->dropped, 1);
+
+        if (queue_policy == DROP_NEWEST) {
+            pthread_mutex_unlock(&c->lock);
+            return;
+        }
+
+        if (queue_policy == DISCONNECT) {
+            c->evicting = 1;
+            pthread_mutex_unlock(&c->lock);
+            request_evict(c);
             return;
         }
+
+        // DROP_OLDEST: a half-written head frame has to be finished or the
+        // reader would lose framing, so drop the one after it instead.
+        size_t victim = q->off ? (q->head + 1) % queue_limit : q->head;
+        msg_put(q->items[victim]);
+        if (victim != q->head)
+            q->items[victim] = q->items[q->head];
+        q->head = (q->head + 1) % queue_limit;
+        q->count--;
+    }
+
+    atomic_fetch_add(&m->refs, 1);
+    q->items[(q->head + q->count++) % queue_limit] = m;
+    atomic_store_explicit(&c->row->queued, q->count, memory_order_relaxed);
+    pthread_mutex_unlock(&c->lock);
+
+    if (!c->dirty) {
+        Shard *sh = c->room->shard;
+        c->dirty = 1;
+        atomic_fetch_add(&c->refs, 1);
+        c->next_dirty = sh->dirty_list;
+        sh->dirty_list = c;
     }
 }
 
-void send_message(const char *sender, const char *uuid, const char *msg)
+// Hand this batch's dirty clients to the writer pool.  Clients already
+// queued or waiting for EPOLLOUT pick the new frames up on their own.
+void schedule_writes(Shard *sh)
 {
-    for (int i = 0; i < client_count; i++) {
-        int fd = open(clients[i].server_fifo, O_WRONLY | O_NONBLOCK);
-        if (fd == -1) continue;
+    while (sh->dirty_list) {
+        Client *c = sh->dirty_list;
+        sh->dirty_list = c->next_dirty;
+        c->dirty = 0;
+
+        pthread_mutex_lock(&c->lock);
+        if (!c->gone && c->out.count > 0 && !c->queued && !c->blocked) {
+            c->queued = 1;
+            atomic_fetch_add(&c->refs, 1);
+            push_ready(c);
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        client_put(c);
+    }
+}
+
+// Caller holds c->lock and gives the ready list one reference.
+void push_ready(Client *c)
+{
+    pthread_mutex_lock(&ready_lock);
+    c->next_ready = NULL;
+    if (ready_tail)
+        ready_tail->next_ready = c;
+    else
+        ready_head = c;
+    ready_tail = c;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+void *writer_thread(void *arg)
+{
+    my_stats = arg;
+
+    while (1) {
+        pthread_mutex_lock(&ready_lock);
+        while (!ready_head)
+            pthread_cond_wait(&ready_cond, &ready_lock);
+        Client *c = ready_head;
+        ready_head = c->next_ready;
+        if (!ready_head) ready_tail = NULL;
+        pthread_mutex_unlock(&ready_lock);
+
+        write_client(c);
+        client_put(c);
+    }
+    return NULL;
+}
+
+// Write as much of the queue as the FIFO takes, IOV_BATCH frames per
+// writev.  A full FIFO never blocks a writer: the client is parked on
+// EPOLLOUT and its shard requeues it once the reader catches up.
+void write_client(Client *c)
+{
+    OutQueue *q = &c->out;
+
+    pthread_mutex_lock(&c->lock);
+    c->queued = 0;
+
+    while (q->count > 0 && !c->gone) {
+        struct iovec iov[IOV_BATCH];
+        int cnt = 0, passed = -1;
+        size_t bytes = 0;
+
+        for (size_t i = 0; i < q->count && cnt < IOV_BATCH; i++) {
+            Msg *m = q->items[(q->head + i) % queue_limit];
+            size_t skip = i == 0 ? q->off : 0;
+            size_t len = m->len - skip;
+
+            // A socket takes each writev as one packet, so packets are
+            // capped at what the client reads at once, and a frame with a
+            // memfd goes in a packet of its own.
+            if (c->is_socket) {
+                if (m->fd != -1) {
+                    if (cnt > 0) break;
+                    passed = m->fd;
+                }
+                if (bytes + len > SOCK_CHUNK) len = SOCK_CHUNK - bytes;
+                if (len == 0) break;
+            }
 
-        if (strcmp(clients[i].uuid, uuid) == 0)
-            dprintf(fd, "You: %s\n", msg);
+            iov[cnt].iov_base = (char *)m->data + skip;
+            iov[cnt].iov_len = len;
+            cnt++;
+            bytes += len;
+            if (passed != -1) break;
+        }
+
+        ssize_t n;
+        if (passed != -1)
+            n = frame_send_fd(c->out_fd, iov, cnt, passed);
         else
-            dprintf(fd, "%s: %s\n", sender, msg);
+            n = writev(c->out_fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
 
-        close(fd);
+            if (errno == EAGAIN) {
+                struct epoll_event ev = {
+                    .events = EPOLLOUT | EPOLLONESHOT,
+                    .data.ptr = OUT_TAG(c),
+                };
+                c->blocked = 1;
+                atomic_fetch_add(&c->refs, 1);
+                epoll_ctl(c->room->shard->epfd, c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                          c->out_fd, &ev);
+                c->registered = 1;
+                break;
+            }
+
+            c->failures++;
+            stats_add(&my_stats->failures, 1);
+            stats_add(&c->row->failures, 1);
+            if (!c->evicting) {
+                c->evicting = 1;
+                pthread_mutex_unlock(&c->lock);
+                request_evict(c);
+                return;
+            }
+            break;
+        }
+
+        stats_add(&my_stats->bytes_out, n);
+        uint64_t now = now_ns(), done = 0;
+
+        while (n > 0) {
+            Msg *m = q->items[q->head];
+            size_t left = m->len - q->off;
+            if ((size_t)n < left) {
+                q->off += n;
+                break;
+            }
+            n -= left;
+            q->off = 0;
+            q->head = (q->head + 1) % queue_limit;
+            q->count--;
+            done++;
+            if (m->born)
+                stats_add(&my_stats->latency[stats_bucket(now - m->born)], 1);
+            msg_put(m);
+        }
+
+        stats_add(&my_stats->frames_out, done);
+        stats_add(&c->row->frames_out, done);
+        atomic_store_explicit(&c->row->queued, q->count, memory_order_relaxed);
     }
+
+    pthread_mutex_unlock(&c->lock);
 }
 
-void *client_thread(void *arg)
+void request_evict(Client *c)
 {
-    Client *c = arg;
-    char buffer[BUF_SIZE];
+    Shard *sh = c->room->shard;
+
+    atomic_fetch_add(&c->refs, 1);
+
+    pthread_mutex_lock(&sh->lock);
+    c->next_evict = sh->evicts;
+    sh->evicts = c;
+    pthread_mutex_unlock(&sh->lock);
+
+    uint64_t one = 1;
+    write(sh->wake_fd, &one, sizeof(one));
+}
+
+
+
+void *shard_thread(void *arg)
+{
+    Shard *sh = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    my_stats = &stats->blocks[1 + (sh - shards)];
 
     while (1) {
-        int fd = open(c->client_fifo, O_RDONLY);
-        if (fd == -1) { usleep(SLEEP_TIME); continue; }
+        int n = epoll_wait(sh->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
 
-        int n = read(fd, buffer, sizeof(buffer) - 1);
-        close(fd);
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &wake_tag)
+                handle_wake(sh);
+            else if ((uintptr_t)tag & 1)
+                handle_writable((Client *)((uintptr_t)tag & ~(uintptr_t)1));
+            else
+                handle_client(tag);
+        }
+
+        schedule_writes(sh);
+    }
+    return NULL;
+}
+
+// Joins from the main thread and disconnects requested by writers or by
+// the queue policy.
+void handle_wake(Shard *sh)
+{
+    uint64_t cnt;
+    read(sh->wake_fd, &cnt, sizeof(cnt));
 
-        if (n <= 0) continue;
+    pthread_mutex_lock(&sh->lock);
+    Join *joins = sh->joins;
+    Client *evicts = sh->evicts;
+    sh->joins = NULL;
+    sh->evicts = NULL;
+    pthread_mutex_unlock(&sh->lock);
 
-        buffer[n] = '\0';
+    // Pushed LIFO; reverse so clients join in registration order.
+    Join *ordered = NULL;
+    while (joins) {
+        Join *j = joins;
+        joins = j->next;
+        j->next = ordered;
+        ordered = j;
+    }
+
+    while (ordered) {
+        Join *j = ordered;
+        ordered = j->next;
+        add_client(j);
+        free(j);
+    }
 
-        if (strcmp(buffer, "close") == 0) {
-            printf("Client '%s' left.\n", c->name);
+    while (evicts) {
+        Client *c = evicts;
+        evicts = c->next_evict;
+
+        if (!c->gone)
+            printf("Client '%s' disconnected (too slow or unreachable).\n", c->name);
+        leave_client(c);
+        client_put(c);
+    }
+}
+
+// Main thread only, like create_room.
+Room *find_room(const char *name)
+{
+    for (Room *r = rooms; r; r = r->next)
+        if (strcmp(r->name, name) == 0)
+            return r;
+    return NULL;
+}
+
+// Rooms are created on their first join and put on the shard with the
+// fewest members (then the fewest rooms), so busy rooms spread out.
+Room *create_room(const char *name)
+{
+    if (name[0] == '.' || strlen(name) != strspn(name,
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-."))
+        return NULL;
+
+    Room *r = calloc(1, sizeof(Room));
+    if (!r) return NULL;
+
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    if (name[0])
+        snprintf(r->dir, sizeof(r->dir), "%s/%s", root, name);
+    else
+        snprintf(r->dir, sizeof(r->dir), "%s", root);
+    mkdir(r->dir, 0777);
+    pthread_rwlock_init(&r->registry.lock, NULL);
+
+    // Sequence numbers carry on from the newest message on disk, so
+    // clients can resume across server restarts.
+    if (use_history) {
+        int64_t last = history_open(&r->history, r->dir);
+        if (last == -1) {
+            printf("Room '%s' runs without history\n", name);
+        } else {
+            r->has_history = 1;
+            r->seq = last;
+        }
+    }
+
+    // Clients learn about the ring from their welcome frame; a stale ring
+    // from an earlier --shm run is removed either way.
+    char ring_path[300];
+    snprintf(ring_path, sizeof(ring_path), "%s/ring", r->dir);
+    unlink(ring_path);
+    if (use_ring) {
+        if (ring_create(&r->ring, ring_path) == -1) {
+            perror(ring_path);
+            free(r);
             return NULL;
         }
+        r->has_ring = 1;
+    }
 
-        send_message(c->name, c->uuid, buffer);
+    Shard *best = &shards[0];
+    for (int i = 1; i < num_shards; i++) {
+        size_t m = atomic_load(&shards[i].members), bm = atomic_load(&best->members);
+        if (m < bm || (m == bm && shards[i].rooms < best->rooms))
+            best = &shards[i];
     }
+    r->shard = best;
+    best->rooms++;
+    atomic_fetch_add(&stats->rooms, 1);
+
+    r->next = rooms;
+    rooms = r;
+    return r;
 }
 
-void *keyboard_thread(void *arg)
+size_t total_members(void)
 {
-    char msg[50];
-    while (1) {
-        fgets(msg, sizeof(msg), stdin);
+    size_t n = 0;
+    for (int i = 0; i < num_shards; i++)
+        n += atomic_load(&shards[i].members);
+    return n;
+}
+
+
+
+static size_t uuid_hash(const char *uuid)
+{
+    // FNV-1a
+    size_t h = 14695981039346656037ULL;
+    for (; *uuid; uuid++) {
+        h ^= (unsigned char)*uuid;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int registry_grow(Registry *r)
+{
+    size_t nb = r->nbuckets ? r->nbuckets * 2 : 64;
+    Client **buckets = calloc(nb, sizeof(Client *));
+    if (!buckets) return -1;
+
+    for (size_t i = 0; i < r->nbuckets; i++) {
+        Client *c = r->buckets[i];
+        while (c) {
+            Client *next = c->hnext;
+            size_t b = uuid_hash(c->uuid) & (nb - 1);
+            c->hnext = buckets[b];
+            buckets[b] = c;
+            c = next;
+        }
+    }
+
+    free(r->buckets);
+    r->buckets = buckets;
+    r->nbuckets = nb;
+    return 0;
+}
+
+// Takes over the caller's reference to c.
+int registry_add(Registry *r, Client *c)
+{
+    int rc = -1;
+    pthread_rwlock_wrlock(&r->lock);
+
+    if (r->count + 1 > r->nbuckets && registry_grow(r) == -1)
+        goto out;
+
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 64;
+        Client **m = realloc(r->members, cap * sizeof(Client *));
+        if (!m) goto out;
+        r->members = m;
+        r->cap = cap;
+    }
+
+    size_t b = uuid_hash(c->uuid) & (r->nbuckets - 1);
+    c->hnext = r->buckets[b];
+    r->buckets[b] = c;
+    c->slot = r->count;
+    r->members[r->count++] = c;
+    rc = 0;
+
+out:
+    pthread_rwlock_unlock(&r->lock);
+    return rc;
+}
 
-        if (strcmp(msg, "close\n") == 0 && client_count == 0) {
-            printf("Chat closed.\n");
-            exit(0);
+// Returns the removed client with the registry's reference, or NULL.
+Client *registry_remove(Registry *r, const char *uuid)
+{
+    pthread_rwlock_wrlock(&r->lock);
+
+    Client *c = NULL;
+    if (r->nbuckets) {
+        Client **pp = &r->buckets[uuid_hash(uuid) & (r->nbuckets - 1)];
+        while (*pp && strcmp((*pp)->uuid, uuid) != 0)
+            pp = &(*pp)->hnext;
+
+        if ((c = *pp) != NULL) {
+            *pp = c->hnext;
+            Client *last = r->members[--r->count];
+            r->members[c->slot] = last;
+            last->slot = c->slot;
+        }
+    }
+
+    pthread_rwlock_unlock(&r->lock);
+    return c;
+}
+
+// Removes c itself, not whichever client holds its UUID now.  Returns 1
+// when c was a member; the registry's reference passes to the caller.
+int registry_remove_client(Registry *r, Client *c)
+{
+    pthread_rwlock_wrlock(&r->lock);
+
+    int found = 0;
+    if (r->nbuckets) {
+        Client **pp = &r->buckets[uuid_hash(c->uuid) & (r->nbuckets - 1)];
+        while (*pp && *pp != c)
+            pp = &(*pp)->hnext;
+
+        if (*pp) {
+            *pp = c->hnext;
+            Client *last = r->members[--r->count];
+            r->members[c->slot] = last;
+            last->slot = c->slot;
+            found = 1;
+        }
+    }
+
+    pthread_rwlock_unlock(&r->lock);
+    return found;
+}
+
+size_t registry_count(Registry *r)
+{
+    pthread_rwlock_rdlock(&r->lock);
+    size_t n = r->count;
+    pthread_rwlock_unlock(&r->lock);
+    return n;
+}
+
+
+
+void send_online(Client *c)
+{
+    Room *room = c->room;
+    char text[200];
+    int len = snprintf(text, sizeof(text), "Welcome %s to chat room %s! online users: %zu",
+                       c->name, room->name[0] ? room->name : root,
+                       registry_count(&room->registry) - 1);
+
+    Msg *m = msg_new(FRAME_SYSTEM, 0, NULL, text, len);
+    if (!m) return;
+
+    // The welcome is the client's acknowledgement that it has joined.
+    ((struct frame_header *)m->buf)->flags |= FRAME_F_JOINED;
+
+    // In --shm mode the welcome tells the client to follow <room>/ring,
+    // starting at the current head: nothing published after this is missed.
+    if (room->has_ring) {
+        struct frame_header *h = (struct frame_header *)m->buf;
+        h->flags |= FRAME_F_RING;
+        h->seq = atomic_load(&room->ring.hdr->head);
+    }
+
+    enqueue(c, m);
+    msg_put(m);
+}
+
+static void queue_history(void *arg, Segment *seg, const char *data, size_t len)
+{
+    Client *c = arg;
+    Msg *m = msg_history(seg, data, len);
+    if (!m) return;
+    enqueue(c, m);
+    msg_put(m);
+}
+
+// Queued right after the welcome and before any later broadcast, so the
+// replay and the live stream join up without gaps or repeats.  In --shm
+// mode the replay still comes through the client's FIFO.
+void send_history(Client *c, int replay, uint64_t arg)
+{
+    Room *room = c->room;
+    if (!room->has_history) return;
+
+    uint64_t since = arg;
+    if (replay != REPLAY_SINCE) {
+        uint64_t last = replay == REPLAY_LAST ? arg : replay_default;
+        since = room->seq > last ? room->seq - last : 0;
+    }
+    if (since >= room->seq) return;
+
+    history_replay(&room->history, since, queue_history, c);
+}
+
+// Every recipient gets the same frame; clients render their own
+// messages as "You:" by comparing the sender UUID with their own.  With a
+// memfd, socket members get it passed along and everyone else gets msg,
+// its first FRAME_MAX_PAYLOAD bytes.  Takes over memfd.
+void send_message(Client *from, const char *msg, size_t len, int memfd)
+{
+    Room *room = from->room;
+    room->seq++;
+
+    if (room->has_ring) {
+        struct frame_header h;
+        frame_init(&h, FRAME_MSG, room->seq, from->uuid, from->name, len);
+        if (room->has_history)
+            history_append(&room->history, &h, msg);
+        ring_publish(&room->ring, &h, msg);
+        stats_add(&my_stats->ring_msgs, 1);
+        stats_add(&my_stats->ring_bytes, sizeof(h) + len);
+        if (memfd != -1) close(memfd);
+        return;
+    }
+
+    Msg *m = msg_new(FRAME_MSG, room->seq, from, msg, len);
+    if (!m) {
+        if (memfd != -1) close(memfd);
+        return;
+    }
+    m->born = now_ns();
+
+    Msg *large = NULL;
+    if (memfd != -1) {
+        struct stat st;
+        fstat(memfd, &st);
+        uint64_t size = st.st_size;
+        large = msg_new(FRAME_MSG, room->seq, from, &size, sizeof(size));
+        if (large) {
+            ((struct frame_header *)large->buf)->flags |= FRAME_F_MEMFD;
+            large->fd = memfd;
+            large->born = m->born;
         } else {
-            printf("Cannot close while clients are connected.\n");
+            close(memfd);
         }
     }
+
+    if (room->has_history)
+        history_append(&room->history, (struct frame_header *)m->buf, m->buf + sizeof(struct frame_header));
+
+    Registry *r = &room->registry;
+    pthread_rwlock_rdlock(&r->lock);
+    for (size_t i = 0; i < r->count; i++) {
+        Client *to = r->members[i];
+        enqueue(to, large && to->is_socket ? large : m);
+    }
+    pthread_rwlock_unlock(&r->lock);
+
+    msg_put(m);
+    if (large) msg_put(large);
+}
+
+// Only sealed memfds are passed on, so no recipient can see the text
+// change or shrink under its mapping.
+void send_large(Client *from, int memfd)
+{
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals == -1 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+        fprintf(stderr, "Unsealed memfd from client '%s'\n", from->name);
+        close(memfd);
+        return;
+    }
+
+    char *head = malloc(FRAME_MAX_PAYLOAD);
+    if (!head) {
+        fprintf(stderr, "Out of memory\n");
+        close(memfd);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(memfd, &st) == 0)
+        stats_add(&my_stats->bytes_in, st.st_size);
+
+    ssize_t n = pread(memfd, head, FRAME_MAX_PAYLOAD, 0);
+    if (n < 0) n = 0;
+    send_message(from, head, n, memfd);
+    free(head);
+}
+
+void handle_client(Client *c)
+{
+    struct frame_header h;
+    const char *payload;
+    ssize_t n;
+    int passed = -1;
+
+    // Left or replaced earlier in this epoll batch: nothing it sent counts
+    if (c->gone)
+        return;
+
+    while ((n = c->is_socket ? frame_recv(c->in, c->in_fd, &passed)
+                             : frame_fill(c->in, c->in_fd)) > 0) {
+        if (passed != -1) {
+            if (c->passed_fd != -1) close(c->passed_fd);
+            c->passed_fd = passed;
+        }
+
+        int rc;
+        while ((rc = frame_next(c->in, &h, &payload)) == 1) {
+            if (h.type == FRAME_CLOSE) {
+                leave_client(c);
+                return;
+            }
+            if (h.type != FRAME_MSG || c->gone) continue;
+
+            stats_add(&my_stats->msgs_in, 1);
+            if (h.flags & FRAME_F_MEMFD) {
+                if (c->passed_fd == -1) continue;
+                send_large(c, c->passed_fd);
+                c->passed_fd = -1;
+            } else {
+                stats_add(&my_stats->bytes_in, h.len);
+                send_message(c, payload, h.len, -1);
+            }
+        }
+
+        if (rc == -1) {
+            fprintf(stderr, "Bad frame from client '%s'\n", c->name);
+            leave_client(c);
+            return;
+        }
+    }
+
+    // Only a socket reports that its peer has gone; a FIFO opened O_RDWR
+    // never reaches EOF.
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+        leave_client(c);
+}
+
+// The FIFO drained: give the blocked client back to the writer pool.
+void handle_writable(Client *c)
+{
+    pthread_mutex_lock(&c->lock);
+    if (!c->blocked) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+
+    // The EPOLLOUT reference moves over to the ready list.
+    c->blocked = 0;
+    c->queued = 1;
+    push_ready(c);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void handle_keyboard(void)
+{
+    char msg[50];
+    int n = read(STDIN_FILENO, msg, sizeof(msg) - 1);
+    if (n <= 0) {
+        // stdin hit EOF: stop reading it but keep serving the rooms
+        close(STDIN_FILENO);
+        return;
+    }
+    msg[n] = '\0';
+
+    if (strcmp(msg, "stats\n") == 0) {
+        print_stats();
+        return;
+    }
+
+    if (strcmp(msg, "close\n") == 0 && total_members() == 0) {
+        printf("Chat closed.\n");
+        for (Room *r = rooms; r; r = r->next) {
+            char ring_path[300];
+            snprintf(ring_path, sizeof(ring_path), "%s/ring", r->dir);
+            if (r->has_ring) unlink(ring_path);
+        }
+        char path[300];
+        snprintf(path, sizeof(path), "%s/stats", root);
+        unlink(path);
+        if (use_socket) {
+            snprintf(path, sizeof(path), "%s/chat.sock", root);
+            unlink(path);
+        }
+        exit(0);
+    } else {
+        printf("Cannot close while clients are connected.\n");
+    }
+}
+
+// "stats" on the server console: outbound queue depth and losses per client
+void print_stats(void)
+{
+    uint64_t total_dropped = 0, total_failures = 0;
+    size_t total_rooms = 0;
+
+    printf("%-20s %-16s %8s %10s %10s   (limit %zu, policy %s)\n", "client", "room",
+           "queued", "dropped", "failed", queue_limit, policy_names[queue_policy]);
+
+    for (Room *room = rooms; room; room = room->next) {
+        Registry *r = &room->registry;
+        total_rooms++;
+
+        pthread_rwlock_rdlock(&r->lock);
+        for (size_t i = 0; i < r->count; i++) {
+            Client *c = r->members[i];
+
+            pthread_mutex_lock(&c->lock);
+            printf("%-20s %-16s %8zu %10llu %10llu\n", c->name,
+                   room->name[0] ? room->name : root, c->out.count,
+                   (unsigned long long)c->dropped, (unsigned long long)c->failures);
+            total_dropped += c->dropped;
+            total_failures += c->failures;
+            pthread_mutex_unlock(&c->lock);
+        }
+        pthread_rwlock_unlock(&r->lock);
+    }
+
+    printf("%zu clients in %zu rooms on %d shards, %llu dropped, %llu failed writes\n",
+           total_members(), total_rooms, num_shards,
+           (unsigned long long)total_dropped, (unsigned long long)total_failures);
 }
@@ -0,0 +1,76 @@
+// Live server statistics, published in <root>/stats.
+//
+// The server maps the file read-write; chatstat (or anything else) maps it
+// read-only and may do so at any time.  Counters never take a lock: every
+// server thread owns one stats_block and is its only writer, so updates
+// are plain relaxed stores, and readers add the blocks up.  Per-client
+// rows are claimed with a compare-and-swap on join and released when the
+// session is freed.
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define STATS_MAGIC 0x54415453u         // "STAT"
+#define STATS_VERSION 1
+#define STATS_BLOCKS 64                 // server threads with counters
+#define STATS_CLIENTS 1024              // client rows; later joins go uncounted
+#define STATS_BUCKETS 32
+
+// Fan-out latency buckets: bucket 0 is under 1 us, bucket i covers
+// [2^(i-1), 2^i) us, the last one everything above.
+static inline int stats_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+struct stats_block {
+    _Atomic uint64_t msgs_in;           // chat messages received from clients
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t frames_out;        // frames fully written to client FIFOs
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t ring_msgs;         // --shm broadcasts
+    _Atomic uint64_t ring_bytes;
+    _Atomic uint64_t dropped;           // frames lost to the queue policy
+    _Atomic uint64_t failures;          // failed writes
+    // Broadcast received to frame written, per recipient
+    _Atomic uint64_t latency[STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct stats_client {
+    _Atomic int used;
+    char name[50];
+    char uuid[40];
+    char room[64];
+    _Atomic uint64_t frames_out;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t failures;
+    _Atomic uint64_t queued;
+};
+
+struct stats_page {
+    uint32_t magic;
+    uint32_t version;
+    int64_t started;                    // time(NULL) at startup
+    int32_t pid;
+    int32_t shards;
+    int32_t writers;
+    _Atomic int32_t rooms;
+    _Atomic int32_t clients;
+    _Atomic uint64_t joins;
+    _Atomic uint64_t leaves;
+    struct stats_block blocks[STATS_BLOCKS];
+    struct stats_client client_rows[STATS_CLIENTS];
+};
+
+// Single writer per counter, so no read-modify-write atomics needed.
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+#endif
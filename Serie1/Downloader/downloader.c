@@ -1,96 +1,254 @@
-#include <stdio.h>      
-#include <stdlib.h>     
-#include <string.h>     
-#include <pthread.h>    
-#include <curl/curl.h> 
-
-#define MAX_THREADS 8    // Maximum number of threads allowed
-
-// Struct to store data for each thread (URL, byte range, and part number)
-struct ThreadData {
-    char url[512];      // URL of the file to download
-    long start;         // Starting byte position for this thread
-    long end;           // Ending byte position for this thread
-    int part_no;        // Thread number (part index)
+#define _GNU_SOURCE     // fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#define MAX_CONNECTIONS 32          // Maximum number of connections allowed
+#define CHUNK_SIZE (1024 * 1024)    // Bytes handed to a connection at a time
+#define MIN_SPLIT (256 * 1024)      // Smallest remainder worth splitting with an idle connection
+#define MAX_RETRIES 3               // Attempts for a range before the download is given up
+#define WRITE_BUF (256 * 1024)      // Bytes a connection collects before writing them out
+#define PAGE_ALIGN 4096             // Writes end on page boundaries, so no page is written twice
+
+// A byte range one connection is downloading
+struct Range {
+    long start;         // First byte of the range
+    long pos;           // Next byte expected from the server
+    long end;           // One past the last byte; lowered when another connection steals the tail
+    int attempts;       // Failed downloads of this range so far
+    int active;         // 1 while a connection is working on it
+};
+
+// Work shared by all connections: the file is handed out in small chunks
+// instead of one slice per connection, so a slow connection holds up at
+// most one chunk.  Only the event loop's thread touches it.
+struct Scheduler {
+    long filesize;
+    long next;                              // First byte not handed out yet
+    struct Range ranges[MAX_CONNECTIONS];   // What each connection is downloading right now
+    struct Range *retry;                    // Remainders of failed downloads, to be tried again
+    int num_retry, retry_cap;
+    int out_fd;                             // The output file, written in place by every connection
+    int failed;                             // A range failed MAX_RETRIES times, or a write failed
+    int whole;                              // Server ignores ranges: one transfer of the whole file, no stealing
+};
+
+// Struct to store data for each connection (curl handle, scheduler, and connection number)
+struct Connection {
+    CURL *curl;         // Kept for every range, so its connection is reused
+    struct Scheduler *sched;
+    int conn_no;        // Connection index
+    int busy;           // 1 while its handle is in the multi stack
+    char *buf;          // Bytes of the current range not written yet
+    size_t buf_len;
+    long buf_off;       // File offset of buf[0]
+    int checked;        // Response code of the current range looked at
+    long bytes;         // Bytes this connection downloaded
+    int num_ranges;     // Ranges it worked on
+    int stolen;         // Of those, taken from another connection
+    long connects;      // New connections it had to open; the rest were reused
 };
 
 
 // Function prototypes (declarations)
 // Each function will be implemented in later stages
-void *download_part(void *arg);                  // Download a specific part of the file
-long get_file_size(const char *url);             // Get total file size via HTTP HEAD
-void merge_files(const char *filename, int num_parts);  // Combine downloaded parts
+int download(CURLM *multi, struct Connection *conns, int num_conns);   // Run every range transfer from one thread
+long get_file_size(const char *url, CURLSH *share, int *ranges);   // Get total file size via HTTP HEAD
+size_t read_header(char *data, size_t size, size_t nmemb, void *userp);    // Look for Accept-Ranges
+int start_range(CURLM *multi, struct Connection *c);    // Put a connection to work on its next range
+void end_range(CURLM *multi, struct Connection *c, CURLcode res);   // Record how a connection's range ended
+int next_range(struct Scheduler *s, int conn, struct Range *out, int *stolen);   // Give a connection its next range
+long finish_range(struct Scheduler *s, int conn);               // Record how a range ended
+size_t write_data(char *data, size_t size, size_t nmemb, void *userp);  // Store bytes of the current range
+int flush_buffer(struct Connection *c, int all);                // Write collected bytes at their offset
 
 
 int main(int argc, char *argv[]) {
     // Check for correct number of arguments
     if (argc < 3) {
-        printf("Usage: %s <url> <num_threads>\n", argv[0]);
+        printf("Usage: %s <url> <num_connections>\n", argv[0]);
         return 1;
     }
 
     const char *url = argv[1];         // File URL
-    int num_threads = atoi(argv[2]);   // Number of threads to use
+    int num_conns = atoi(argv[2]);     // Number of connections to use
 
-    // Limit threads to MAX_THREADS
-    if (num_threads > MAX_THREADS)
-        num_threads = MAX_THREADS;
+    // Limit connections to MAX_CONNECTIONS
+    if (num_conns > MAX_CONNECTIONS)
+        num_conns = MAX_CONNECTIONS;
+    if (num_conns < 1)
+        num_conns = 1;
 
     // Initialize CURL globally
     curl_global_init(CURL_GLOBAL_ALL);
 
+    // Every handle shares DNS answers, open connections and TLS sessions,
+    // so the HEAD request's connection carries the first range and later
+    // connections resume TLS instead of a full handshake.  Everything runs
+    // on one thread, so the share needs no locks.
+    CURLSH *share = curl_share_init();
+    CURLM *multi = curl_multi_init();
+    if (!share || !multi) {
+        printf("Error: could not set up curl\n");
+        curl_global_cleanup();
+        return 1;
+    }
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
     // Get total file size from server
-    long filesize = get_file_size(url);
+    int ranges = 0;
+    long filesize = get_file_size(url, share, &ranges);
+    if (filesize < 0) {
+        curl_multi_cleanup(multi);
+        curl_share_cleanup(share);
+        curl_global_cleanup();
+        return 1;
+    }
     printf("File size: %ld bytes\n", filesize);
 
-    // Calculate the size of each part
-    long part_size = filesize / num_threads;
+    // Without ranges the file can only come in one piece
+    if (!ranges && num_conns > 1) {
+        printf("Server does not accept ranges, using 1 connection\n");
+        num_conns = 1;
+    }
+
+    // Every connection starts with a chunk from the front of the file
+    struct Scheduler sched;
+    memset(&sched, 0, sizeof(sched));
+    sched.filesize = filesize;
+    sched.whole = !ranges;
+
+    // Reserve the whole file up front: every connection writes its bytes
+    // straight to their place, so there are no part files to merge
+    sched.out_fd = open("output_file", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (sched.out_fd == -1) {
+        perror("output_file");
+        curl_multi_cleanup(multi);
+        curl_share_cleanup(share);
+        curl_global_cleanup();
+        return 1;
+    }
+    if (filesize > 0 && fallocate(sched.out_fd, 0, 0, filesize) != 0) {
+        // Filesystems without fallocate still get the right size
+        if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(sched.out_fd, filesize) != 0) {
+            perror("output_file");
+            close(sched.out_fd);
+            remove("output_file");
+            curl_multi_cleanup(multi);
+            curl_share_cleanup(share);
+            curl_global_cleanup();
+            return 1;
+        }
+    }
+
+    struct Connection conns[MAX_CONNECTIONS];
+    memset(conns, 0, sizeof(conns));
+
+    // Set up one handle per connection; they only differ in their ranges
+    for (int i = 0; i < num_conns; i++) {
+        struct Connection *c = &conns[i];
+        c->sched = &sched;
+        c->conn_no = i;
+        c->curl = curl_easy_init();
+        c->buf = malloc(WRITE_BUF);
+        if (!c->curl || !c->buf) {
+            printf("Error: connection %d could not start\n", i);
+            sched.failed = 1;
+            break;
+        }
 
-    pthread_t threads[MAX_THREADS];
-    struct ThreadData tdata[MAX_THREADS];
+        // Set file URL and the share
+        curl_easy_setopt(c->curl, CURLOPT_URL, url);
+        curl_easy_setopt(c->curl, CURLOPT_SHARE, share);
 
-    // Create threads for each part
-    for (int i = 0; i < num_threads; i++) {
-        tdata[i].start = i * part_size;
-        tdata[i].end = (i == num_threads - 1) ? filesize : (i + 1) * part_size;
-        strcpy(tdata[i].url, url);
-        tdata[i].part_no = i;
+        // Follow redirects, as the HEAD request did
+        curl_easy_setopt(c->curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-        pthread_create(&threads[i], NULL, download_part, &tdata[i]);
+        // Our write callback checks every block against the range's end
+        curl_easy_setopt(c->curl, CURLOPT_WRITEFUNCTION, write_data);
+        curl_easy_setopt(c->curl, CURLOPT_WRITEDATA, c);
+
+        // Find the connection again when its transfer is done
+        curl_easy_setopt(c->curl, CURLOPT_PRIVATE, c);
+
+        // Treat HTTP errors as failed ranges instead of storing the error page
+        curl_easy_setopt(c->curl, CURLOPT_FAILONERROR, 1L);
+
+        // Larger blocks from curl mean fewer callbacks
+        curl_easy_setopt(c->curl, CURLOPT_BUFFERSIZE, (long)WRITE_BUF);
+
+        // Keep idle connections alive between chunks
+        curl_easy_setopt(c->curl, CURLOPT_TCP_KEEPALIVE, 1L);
     }
 
-    // Wait for all threads to complete
-    for (int i = 0; i < num_threads; i++)
-        pthread_join(threads[i], NULL);
+    // Run every transfer until no range is left
+    if (!sched.failed && download(multi, conns, num_conns) != 0)
+        sched.failed = 1;
 
-    // Merge all downloaded parts into one final file
-    merge_files("output_file", num_threads);
+    for (int i = 0; i < num_conns; i++) {
+        if (conns[i].curl) {
+            printf("Connection %d downloaded %ld bytes in %d ranges (%d stolen, %ld connects)\n",
+                   i, conns[i].bytes, conns[i].num_ranges, conns[i].stolen, conns[i].connects);
+            curl_easy_cleanup(conns[i].curl);
+        }
+        free(conns[i].buf);
+    }
+
+    // Every byte is already in place
+    if (close(sched.out_fd) != 0) {
+        perror("output_file");
+        sched.failed = 1;
+    }
+    if (sched.failed) {
+        printf("Error: download failed\n");
+        remove("output_file");
+    } else {
+        printf("Download complete!\n");
+    }
 
-    printf("Download complete!\n");
+    free(sched.retry);
 
     // Clean up CURL resources
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
     curl_global_cleanup();
 
-    return 0;
+    return sched.failed ? 1 : 0;
 }
 
 
-long get_file_size(const char *url) {
+long get_file_size(const char *url, CURLSH *share, int *ranges) {
     CURL *curl;
     CURLcode res;
-    double filesize = -1.0;
+    curl_off_t filesize = -1;
 
     curl = curl_easy_init();
     if (curl) {
         // Set the target URL
         curl_easy_setopt(curl, CURLOPT_URL, url);
 
+        // Leave DNS answer, connection and TLS session to the range transfers
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
         // Use HEAD request (only get headers, not file content)
         curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
 
         // Follow redirects if the URL points somewhere else
         curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
+        // The size of an error page is not the file's
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+
+        // Find out whether the file can be downloaded in ranges
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, ranges);
+
         // Perform the request
         res = curl_easy_perform(curl);
 
@@ -115,77 +273,309 @@ long get_file_size(const char *url) {
 
 
 
-// Function to download a specific byte range of a file (used by each thread)
-void *download_part(void *arg) {
-    struct ThreadData *data = (struct ThreadData *)arg;  // Cast argument to ThreadData
-    CURL *curl = curl_easy_init();                       // Initialize CURL handle
-    FILE *fp;
-    char range[64], outname[64];
+// Header callback of the HEAD request: sets *userp when the final
+// response offers byte ranges.  A redirect's headers are forgotten when
+// the next status line arrives.
+size_t read_header(char *data, size_t size, size_t nmemb, void *userp) {
+    int *ranges = (int *)userp;
+    size_t n = size * nmemb;
 
-    // Create output filename like "part_0.bin"
-    sprintf(outname, "part_%d.bin", data->part_no);
-    fp = fopen(outname, "wb");
+    if (n >= 5 && strncmp(data, "HTTP/", 5) == 0) {
+        *ranges = 0;
+    } else if (n > 14 && strncasecmp(data, "Accept-Ranges:", 14) == 0) {
+        const char *v = data + 14;
+        while (v < data + n && *v == ' ')
+            v++;
+        if (data + n - v >= 5 && strncasecmp(v, "bytes", 5) == 0)
+            *ranges = 1;
+    }
+    return n;
+}
 
-    // Define the byte range to download (e.g., "0-999")
-    sprintf(range, "%ld-%ld", data->start, data->end - 1);
 
-    if (curl) {
 
-        
-        // Set file URL
-        curl_easy_setopt(curl, CURLOPT_URL, data->url);
-        
-        // Set output file pointer
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-        
-        // Use default write callback
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
-        
-        // Specify byte range for partial download
-        curl_easy_setopt(curl, CURLOPT_RANGE, range);
-        
+// Function to drive every connection from this one thread.  A connection
+// whose range is done starts its next one on the same handle, which
+// takes its keep-alive connection back from the cache.  Idle connections
+// are offered work again whenever a range ends, since that may have left
+// a failed remainder or a range worth splitting.
+int download(CURLM *multi, struct Connection *conns, int num_conns) {
+    int running = 0;
 
-        // Perform the request
-        curl_easy_perform(curl);
+    for (int i = 0; i < num_conns; i++)
+        start_range(multi, &conns[i]);
 
-        // Clean up CURL resources
-        curl_easy_cleanup(curl);
-    }    
+    while (1) {
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc != CURLM_OK) {
+            printf("Error: %s\n", curl_multi_strerror(mc));
+            return -1;
+        }
+
+        // Collect finished transfers
+        int ended = 0, left;
+        CURLMsg *msg;
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            struct Connection *c;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&c);
+            end_range(multi, c, msg->data.result);
+            ended = 1;
+        }
+
+        if (ended) {
+            for (int i = 0; i < num_conns; i++) {
+                if (!conns[i].busy)
+                    start_range(multi, &conns[i]);
+            }
+        }
+
+        // Nothing in flight and nothing could be started: done
+        int busy = 0;
+        for (int i = 0; i < num_conns; i++)
+            busy += conns[i].busy;
+        if (busy == 0)
+            return 0;
+
+        // Sleep until a socket is ready or curl has a timeout to handle
+        mc = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+        if (mc != CURLM_OK) {
+            printf("Error: %s\n", curl_multi_strerror(mc));
+            return -1;
+        }
+    }
+}
+
+
+
+// Function to hand a connection its next range and add its handle to the
+// multi stack.  Returns 0 when there is nothing for it to do.
+int start_range(CURLM *multi, struct Connection *c) {
+    struct Range r;
+    int stolen;
+    char range[64];
+
+    if (!next_range(c->sched, c->conn_no, &r, &stolen))
+        return 0;
+
+    // The range's bytes go straight to their offset in the output file
+    c->buf_len = 0;
+    c->buf_off = r.start;
+    c->checked = 0;
+    c->stolen += stolen;
+
+    // Define the byte range to download (e.g., "0-1048575"); a server
+    // without ranges gets a plain GET
+    sprintf(range, "%ld-%ld", r.start, r.end - 1);
+    curl_easy_setopt(c->curl, CURLOPT_RANGE, c->sched->whole ? NULL : range);
+
+    CURLMcode mc = curl_multi_add_handle(multi, c->curl);
+    if (mc != CURLM_OK) {
+        printf("Error: %s\n", curl_multi_strerror(mc));
+        c->sched->failed = 1;
+        finish_range(c->sched, c->conn_no);
+        return 0;
+    }
+    c->busy = 1;
+    return 1;
+}
 
-    fclose(fp); // Close output file
-    printf("Thread %d downloaded bytes %ld-%ld\n", data->part_no, data->start, data->end - 1);
 
-    return NULL; // Thread returns nothing
-}    
 
+// Function to wrap up a connection's transfer.  A stolen tail ends the
+// transfer with a write error, which is fine as long as the range is
+// complete; anything else short of the end is retried by finish_range.
+void end_range(CURLM *multi, struct Connection *c, CURLcode res) {
+    struct Range r = c->sched->ranges[c->conn_no];
 
+    if (res != CURLE_OK && r.pos < r.end && !c->sched->failed) {
+        printf("Connection %d: bytes %ld-%ld: %s\n", c->conn_no, r.pos, r.end - 1, curl_easy_strerror(res));
+    }
 
+    long connects = 0;
+    curl_easy_getinfo(c->curl, CURLINFO_NUM_CONNECTS, &connects);
+    c->connects += connects;
 
-// Function to merge all downloaded parts into one final file
-void merge_files(const char *filename, int num_parts) {
-    FILE *final = fopen(filename, "wb");   // Open final output file
-    char part_name[64];
-    FILE *part;
-    char buffer[8192];                     // Temporary buffer for data transfer
-    size_t n;
+    curl_multi_remove_handle(multi, c->curl);
+    c->busy = 0;
 
-    // Loop through all parts in correct order
-    for (int i = 0; i < num_parts; i++) {
-        sprintf(part_name, "part_%d.bin", i);   // Build part filename (e.g., part_0.bin)
-        part = fopen(part_name, "rb");          // Open part file for reading
+    // Write whatever is left of the range before giving it up
+    flush_buffer(c, 1);
+    c->bytes += finish_range(c->sched, c->conn_no);
+    c->num_ranges++;
+}
 
-        // Read from part and write into final file
-        while ((n = fread(buffer, 1, sizeof(buffer), part)) > 0)
-            fwrite(buffer, 1, n, final);
 
-        fclose(part);       // Close part file
-        remove(part_name);  // Delete part file after merging
-    }    
 
-    fclose(final); // Close final merged file
-}    
+// Function to pick the next range for a connection.  Failed ranges come
+// first, then fresh chunks from the front of the file.  When none are
+// left, the connection splits the range with the most bytes still to come
+// (the one that would finish last) and takes its second half.
+// Returns 0 when there is nothing left to do.
+int next_range(struct Scheduler *s, int conn, struct Range *out, int *stolen) {
+    struct Range r = { 0 };
+    int found = 0;
+    *stolen = 0;
+
+    if (s->failed) {
+        // Another range failed for good: stop
+    } else if (s->num_retry > 0) {
+        r = s->retry[--s->num_retry];
+        found = 1;
+    } else if (s->next < s->filesize) {
+        r.start = s->next;
+        r.end = (s->filesize - s->next > CHUNK_SIZE && !s->whole) ? s->next + CHUNK_SIZE : s->filesize;
+        s->next = r.end;
+        found = 1;
+    } else if (!s->whole) {
+        // Queue is empty: steal the tail of the slowest range
+        int victim = -1;
+        long most = 0;
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            long left = s->ranges[i].end - s->ranges[i].pos;
+            if (i != conn && s->ranges[i].active && left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim != -1 && most >= MIN_SPLIT) {
+            // The victim stops at mid; its write callback sees the new end.
+            // mid is page aligned, so the two halves never share a page.
+            long mid = (s->ranges[victim].pos + most / 2 + PAGE_ALIGN - 1) & ~(long)(PAGE_ALIGN - 1);
+            r.start = mid;
+            r.end = s->ranges[victim].end;
+            s->ranges[victim].end = mid;
+            found = 1;
+            *stolen = 1;
+        }
+    }
+
+    if (found) {
+        r.pos = r.start;
+        r.active = 1;
+        s->ranges[conn] = r;
+        *out = r;
+    }
+
+    return found;
+}
 
 
 
+// Function to close the current range of a connection.  The file holds
+// [start, pos) of it; a range that did not reach its end goes back to the
+// queue from pos on.  Returns the bytes written.
+long finish_range(struct Scheduler *s, int conn) {
+    struct Range *r = &s->ranges[conn];
+    r->active = 0;
+    long written = r->pos - r->start;
 
+    // Try the rest again, on whichever connection is free first.  Without
+    // ranges the only way to the rest is the whole file again.
+    if (r->pos < r->end) {
+        struct Range rest = *r;
+        rest.start = s->whole ? 0 : r->pos;
+        rest.attempts++;
 
+        if (rest.attempts >= MAX_RETRIES) {
+            printf("Error: bytes %ld-%ld failed %d times\n", rest.start, rest.end - 1, rest.attempts);
+            s->failed = 1;
+        } else {
+            if (s->num_retry == s->retry_cap) {
+                int new_cap = (s->retry_cap == 0 ? 8 : s->retry_cap * 2);
+                struct Range *tmp = realloc(s->retry, new_cap * sizeof(struct Range));
+                if (tmp) {
+                    s->retry = tmp;
+                    s->retry_cap = new_cap;
+                }
+            }
+            if (s->num_retry < s->retry_cap)
+                s->retry[s->num_retry++] = rest;
+            else
+                s->failed = 1;
+        }
+    }
+
+    return written;
+}
+
+
+
+// Write callback: store what belongs to the current range.  Once the
+// range's end has been lowered by a thief, the rest is not ours; returning
+// less than we were given stops the transfer.
+size_t write_data(char *data, size_t size, size_t nmemb, void *userp) {
+    struct Connection *c = (struct Connection *)userp;
+    struct Scheduler *s = c->sched;
+    struct Range *r = &s->ranges[c->conn_no];
+    size_t n = size * nmemb;
+
+    // The first bytes show whether the server honoured the range.  A 200
+    // is the file from its start: fine for the range at 0, which then
+    // becomes the whole file, and nothing more is handed out or stolen.
+    // Any other range would write the file's start at its offset.
+    if (!c->checked) {
+        long code = 0;
+        curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &code);
+        c->checked = 1;
+        if (code == 200 && r->start == 0) {
+            r->end = s->filesize;
+            s->next = s->filesize;
+            s->whole = 1;
+        } else if (code == 200) {
+            printf("Error: server ignored the range at byte %ld, try 1 connection\n", r->start);
+            s->failed = 1;
+            return 0;
+        }
+    }
+
+    long room = r->end - r->pos;
+    size_t take = (long)n < room ? n : (size_t)room;
+    r->pos += take;
+
+    // Collect them; a full buffer is written out up to a page boundary
+    size_t done = 0;
+    while (done < take) {
+        if (c->buf_len == WRITE_BUF && flush_buffer(c, 0) != 0)
+            return 0;
+        size_t len = take - done < WRITE_BUF - c->buf_len ? take - done : WRITE_BUF - c->buf_len;
+        memcpy(c->buf + c->buf_len, data + done, len);
+        c->buf_len += len;
+        done += len;
+    }
+    return take;
+}
+
+
+
+// Function to write a connection's collected bytes at their place in the
+// output file.  Unless all is set, only up to the last page boundary is
+// written and the rest (less than a page) is kept for the next write, so
+// the kernel never has to read back a partly written page.
+int flush_buffer(struct Connection *c, int all) {
+    size_t len = c->buf_len;
+    if (!all) {
+        long end = (c->buf_off + (long)c->buf_len) & ~(long)(PAGE_ALIGN - 1);
+        if (end > c->buf_off)
+            len = end - c->buf_off;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(c->sched->out_fd, c->buf + done, len - done, c->buf_off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("output_file");
+            c->sched->failed = 1;
+            return -1;
+        }
+        done += n;
+    }
+
+    memmove(c->buf, c->buf + len, c->buf_len - len);
+    c->buf_len -= len;
+    c->buf_off += len;
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Slab storage for the walk's directory nodes and -s file names.
+//
+// Each worker carves objects out of its own 16 KiB slab with a bump
+// pointer, so queueing a directory or a file costs no malloc.  A slab
+// counts the objects still alive in it; any thread may free one, and the
+// slab goes back to a shared pool as a whole once its last object is gone
+// and its owner has moved on to a new slab.  The walk is depth first, so
+// a slab mostly holds one subtree and is released when that subtree is
+// done.  Slabs are aligned to their size: an object finds its slab by
+// masking its own address.
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define ARENA_BLOCK (16 * 1024)
+#define ARENA_ALIGN 8
+
+typedef struct arena_block {
+    atomic_long live;           // objects not freed yet, +1 while its owner allocates from it
+    struct arena_block *next;   // in the pool
+    size_t size;                // 0 for a slab; bytes of a block holding one large object
+} arena_block_t;
+
+// Empty slabs, shared by all workers
+typedef struct {
+    pthread_mutex_t lock;
+    arena_block_t *free;
+} arena_pool_t;
+
+typedef struct {
+    arena_pool_t *pool;
+    arena_block_t *cur;
+    size_t used;                // bytes of cur handed out, header included
+} arena_t;
+
+#define ARENA_HEADER ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static inline void arena_put_block(arena_pool_t *pool, arena_block_t *b) {
+    if (b->size) {
+        free(b);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    b->next = pool->free;
+    pool->free = b;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline arena_block_t *arena_get_block(arena_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    arena_block_t *b = pool->free;
+    if (b) pool->free = b->next;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!b) {
+        b = aligned_alloc(ARENA_BLOCK, ARENA_BLOCK);
+        if (!b)
+            return NULL;
+    }
+    atomic_init(&b->live, 1);
+    b->next = NULL;
+    b->size = 0;
+    return b;
+}
+
+// Give up the current slab; it is released with its last object
+static inline void arena_retire(arena_t *a) {
+    if (a->cur && atomic_fetch_sub(&a->cur->live, 1) == 1)
+        arena_put_block(a->pool, a->cur);
+    a->cur = NULL;
+}
+
+static inline void *arena_alloc(arena_t *a, size_t size) {
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    // too large for a slab (a long start directory): a block of its own,
+    // still aligned so arena_free finds the header
+    if (size > ARENA_BLOCK - ARENA_HEADER) {
+        size_t bytes = (ARENA_HEADER + size + ARENA_BLOCK - 1) & ~(size_t)(ARENA_BLOCK - 1);
+        arena_block_t *b = aligned_alloc(ARENA_BLOCK, bytes);
+        if (!b)
+            return NULL;
+        atomic_init(&b->live, 1);
+        b->size = bytes;
+        return (char *)b + ARENA_HEADER;
+    }
+
+    if (!a->cur || a->used + size > ARENA_BLOCK) {
+        arena_retire(a);
+        a->cur = arena_get_block(a->pool);
+        if (!a->cur)
+            return NULL;
+        a->used = ARENA_HEADER;
+    }
+
+    void *p = (char *)a->cur + a->used;
+    a->used += size;
+    atomic_fetch_add_explicit(&a->cur->live, 1, memory_order_relaxed);
+    return p;
+}
+
+// From any thread
+static inline void arena_free(arena_pool_t *pool, void *p) {
+    arena_block_t *b = (arena_block_t *)((uintptr_t)p & ~(uintptr_t)(ARENA_BLOCK - 1));
+    if (atomic_fetch_sub(&b->live, 1) == 1)
+        arena_put_block(pool, b);
+}
+
+static inline void arena_pool_destroy(arena_pool_t *pool) {
+    while (pool->free) {
+        arena_block_t *b = pool->free;
+        pool->free = b->next;
+        free(b);
+    }
+    pthread_mutex_destroy(&pool->lock);
+}
+
+#endif
@@ -0,0 +1,516 @@
+// Traversal benchmark for the finder.
+//
+// Generates a synthetic tree (depth, fanout, files per directory, name
+// length) and runs finder.out over it once per strategy, i.e. per set of
+// finder options.  Every run is a separate process: wall time comes from
+// the clock, peak RSS from wait4, peak threads from sampling
+// /proc/<pid>/status, and entries and syscalls from the finder's own -v
+// counters.  A deep chain of directories checks that no strategy hangs on
+// trees deeper than the old 32-slot semaphore (the search_dir deadlock).
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <ftw.h>
+#include <signal.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_STRATEGIES 16
+#define MAX_ARGS 32
+#define MAX_RUNS 64
+#define DEEP_TARGET "deep-target"
+#define MISSING_TARGET "no-such-name"   // nothing matches: the whole tree is walked
+
+static int depth = 4;
+static int fanout = 8;
+static int files = 16;
+static int name_len = 12;
+static int deep = 256;                  // 0 skips the deadlock regression
+static int runs = 3;
+static double timeout_s = 30;
+static int keep = 0;
+static const char *finder = "./finder.out";
+static const char *base_dir = NULL;     // tmpfs when there is one
+
+static const char *strategies[MAX_STRATEGIES];
+static int num_strategies = 0;
+
+static char root[4096];
+static long gen_dirs, gen_entries;
+
+// What one finder process did
+typedef struct {
+    int ok;                     // exited 0 in time, with a counters line
+    int timed_out;
+    double seconds;
+    long max_rss_kb;
+    int max_threads;
+    long dirs, entries, opens, stats, statx, enters, reads;
+    int workers;
+    int found_target;           // stdout named the target
+} run_result_t;
+
+
+static void usage(void);
+static uint64_t now_ns(void);
+static void make_name(char *buf, char kind, long i);
+static int gen_tree(int dfd, int level);
+static int gen_deep(int dfd, int levels);
+static int read_threads(pid_t pid);
+static int drain(int fd, char *buf, size_t *len, size_t cap);
+static int run_finder(const char *strategy, const char *dir, const char *target, run_result_t *r);
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+static void sort_seconds(double *secs, int n);
+
+
+
+int main(int argc, char *argv[]) {
+
+    static const struct option opts[] = {
+        { "depth",    required_argument, NULL, 'd' },
+        { "fanout",   required_argument, NULL, 'f' },
+        { "files",    required_argument, NULL, 'n' },
+        { "name-len", required_argument, NULL, 'l' },
+        { "strategy", required_argument, NULL, 's' },
+        { "runs",     required_argument, NULL, 'r' },
+        { "deep",     required_argument, NULL, 'D' },
+        { "timeout",  required_argument, NULL, 't' },
+        { "finder",   required_argument, NULL, 'F' },
+        { "dir",      required_argument, NULL, 'o' },
+        { "keep",     no_argument,       NULL, 'k' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'd': depth = atoi(optarg); break;
+        case 'f': fanout = atoi(optarg); break;
+        case 'n': files = atoi(optarg); break;
+        case 'l': name_len = atoi(optarg); break;
+        case 's':
+            if (num_strategies == MAX_STRATEGIES) {
+                fprintf(stderr, "At most %d strategies\n", MAX_STRATEGIES);
+                return 1;
+            }
+            strategies[num_strategies++] = optarg;
+            break;
+        case 'r': runs = atoi(optarg); break;
+        case 'D': deep = atoi(optarg); break;
+        case 't': timeout_s = atof(optarg); break;
+        case 'F': finder = optarg; break;
+        case 'o': base_dir = optarg; break;
+        case 'k': keep = 1; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc != optind || depth < 0 || fanout < 1 || files < 0 || deep < 0 ||
+        runs < 1 || runs > MAX_RUNS || timeout_s <= 0) {
+        usage();
+        return 1;
+    }
+    if (name_len < 8) name_len = 8;     // room for the unique prefix
+    if (name_len > 255) name_len = 255;
+
+    // one worker, all cores, all cores with io_uring
+    if (num_strategies == 0) {
+        strategies[num_strategies++] = "-j 1";
+        strategies[num_strategies++] = "";
+        strategies[num_strategies++] = "-u";
+    }
+
+    if (access(finder, X_OK) != 0) {
+        perror(finder);
+        return 1;
+    }
+
+    struct stat st;
+    if (!base_dir) {
+        base_dir = stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode) ? "/dev/shm" : "/tmp";
+    }
+    snprintf(root, sizeof(root), "%s/finder-bench.XXXXXX", base_dir);
+    if (!mkdtemp(root)) {
+        perror(root);
+        return 1;
+    }
+
+    // trees are built with *at calls, so depth is not limited by PATH_MAX
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1 || mkdirat(root_fd, "tree", 0755) != 0 || mkdirat(root_fd, "deep", 0755) != 0) {
+        perror(root);
+        return 1;
+    }
+
+    fprintf(stderr, "Generating tree in %s/tree...\n", root);
+    uint64_t gen_start = now_ns();
+    int tree_fd = openat(root_fd, "tree", O_RDONLY | O_DIRECTORY);
+    int rc = tree_fd == -1 ? -1 : gen_tree(tree_fd, 0);
+    if (tree_fd != -1) close(tree_fd);
+    if (rc == 0 && deep > 0) {
+        int deep_fd = openat(root_fd, "deep", O_RDONLY | O_DIRECTORY);
+        rc = deep_fd == -1 ? -1 : gen_deep(deep_fd, deep);
+    }
+    close(root_fd);
+    if (rc != 0) {
+        perror("generate");
+        if (!keep) nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+    double gen_s = (now_ns() - gen_start) / 1e9;
+    fprintf(stderr, "%ld directories, %ld entries in %.1f s\n", gen_dirs, gen_entries, gen_s);
+
+    char tree[4200], deep_dir[4200];
+    snprintf(tree, sizeof(tree), "%s/tree", root);
+    snprintf(deep_dir, sizeof(deep_dir), "%s/deep", root);
+
+    int failed = 0;
+
+    printf("{\n");
+    printf("  \"dir\": \"%s\",\n", root);
+    printf("  \"depth\": %d,\n", depth);
+    printf("  \"fanout\": %d,\n", fanout);
+    printf("  \"files\": %d,\n", files);
+    printf("  \"name_len\": %d,\n", name_len);
+    printf("  \"directories\": %ld,\n", gen_dirs);
+    printf("  \"entries\": %ld,\n", gen_entries);
+    printf("  \"runs\": %d,\n", runs);
+    printf("  \"strategies\": [\n");
+
+    for (int s = 0; s < num_strategies; s++) {
+
+        fprintf(stderr, "Strategy \"%s\"...\n", strategies[s]);
+
+        // the first run also warms the cache; it is not reported
+        run_result_t r;
+        run_finder(strategies[s], tree, MISSING_TARGET, &r);
+
+        double secs[MAX_RUNS];
+        run_result_t last = { 0 };
+        int good = 0, peak_threads = 0;
+        long peak_rss = 0;
+        for (int i = 0; i < runs; i++) {
+            if (run_finder(strategies[s], tree, MISSING_TARGET, &r) != 0 || !r.ok)
+                continue;
+            secs[good++] = r.seconds;
+            if (r.max_threads > peak_threads) peak_threads = r.max_threads;
+            if (r.max_rss_kb > peak_rss) peak_rss = r.max_rss_kb;
+            last = r;
+        }
+
+        printf("    { \"strategy\": \"%s\", ", strategies[s]);
+        if (good == 0) {
+            printf("\"ok\": false }%s\n", s + 1 < num_strategies ? "," : "");
+            failed = 1;
+            continue;
+        }
+
+        sort_seconds(secs, good);
+        double median = secs[good / 2], best = secs[0];
+        long syscalls = last.opens + last.stats + last.enters + last.reads;
+        double per_entry = last.entries > 0 ? (double)syscalls / last.entries : 0;
+
+        printf("\"ok\": true, \"workers\": %d, \"entries\": %ld,\n", last.workers, last.entries);
+        printf("      \"seconds\": { \"median\": %.4f, \"best\": %.4f },\n", median, best);
+        printf("      \"entries_per_sec\": { \"median\": %.0f, \"best\": %.0f },\n",
+               last.entries / median, last.entries / best);
+        printf("      \"syscalls\": { \"opens\": %ld, \"stats\": %ld, \"io_uring_enter\": %ld, "
+               "\"reads\": %ld, \"per_entry\": %.4f }, \"uring_statx\": %ld,\n",
+               last.opens, last.stats, last.enters, last.reads, per_entry, last.statx);
+        printf("      \"peak_threads\": %d, \"peak_rss_kb\": %ld }%s\n",
+               peak_threads, peak_rss, s + 1 < num_strategies ? "," : "");
+    }
+    printf("  ]");
+
+    // the old search_dir held a semaphore slot while joining its children;
+    // 32 levels deep every slot was held by a waiting parent
+    if (deep > 0) {
+        printf(",\n  \"deep\": { \"depth\": %d, \"results\": [\n", deep);
+        for (int s = 0; s < num_strategies; s++) {
+            fprintf(stderr, "Deep tree, strategy \"%s\"...\n", strategies[s]);
+            run_result_t r;
+            int ok = run_finder(strategies[s], deep_dir, DEEP_TARGET, &r) == 0 &&
+                     r.ok && r.found_target;
+            if (!ok) failed = 1;
+            printf("    { \"strategy\": \"%s\", \"ok\": %s, \"timed_out\": %s, \"seconds\": %.4f }%s\n",
+                   strategies[s], ok ? "true" : "false", r.timed_out ? "true" : "false",
+                   r.seconds, s + 1 < num_strategies ? "," : "");
+        }
+        printf("  ] }");
+    }
+    printf(",\n  \"passed\": %s\n}\n", failed ? "false" : "true");
+
+    if (!keep) nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+
+    return failed;
+}
+
+
+
+static void usage(void) {
+
+    printf("Usage: ./bench [--depth N] [--fanout N] [--files N] [--name-len N]\n"
+           "               [--strategy \"FINDER OPTIONS\"]... [--runs N] [--deep N]\n"
+           "               [--timeout SECONDS] [--finder PATH] [--dir PATH] [--keep]\n");
+}
+
+
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+
+// Unique within a directory: kind and index in hex, padded to name_len
+static void make_name(char *buf, char kind, long i) {
+
+    int n = snprintf(buf, name_len + 1, "%c%lx_", kind, i);
+    for (; n < name_len; n++) {
+        buf[n] = 'a' + (n + i) % 26;
+    }
+    buf[name_len] = '\0';
+}
+
+
+
+static int gen_tree(int dfd, int level) {
+
+    char name[256];
+    gen_dirs++;
+
+    for (int i = 0; i < files; i++) {
+        make_name(name, 'f', i);
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1)
+            return -1;
+        close(fd);
+        gen_entries++;
+    }
+
+    if (level == depth)
+        return 0;
+
+    for (int i = 0; i < fanout; i++) {
+        make_name(name, 'd', i);
+        if (mkdirat(dfd, name, 0755) != 0)
+            return -1;
+        gen_entries++;
+
+        int sub = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sub == -1)
+            return -1;
+        int rc = gen_tree(sub, level + 1);
+        close(sub);
+        if (rc != 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+
+// A chain of single directories with the target at the bottom.  Takes
+// ownership of dfd.
+static int gen_deep(int dfd, int levels) {
+
+    for (int i = 0; i < levels; i++) {
+        int sub = -1;
+        if (mkdirat(dfd, "d", 0755) == 0)
+            sub = openat(dfd, "d", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(dfd);
+        if (sub == -1)
+            return -1;
+        dfd = sub;
+    }
+
+    int fd = openat(dfd, DEEP_TARGET, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    close(dfd);
+    if (fd == -1)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+
+
+// "Threads:" from /proc/<pid>/status, 0 once the process is gone
+static int read_threads(pid_t pid) {
+
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    char *t = strstr(buf, "\nThreads:");
+    return t ? atoi(t + 9) : 0;
+}
+
+
+
+// Drain a child's pipe into buf (keeping at most cap - 1 bytes); 0 at EOF
+static int drain(int fd, char *buf, size_t *len, size_t cap) {
+
+    char tmp[4096];
+    ssize_t n = read(fd, tmp, sizeof(tmp));
+    if (n <= 0)
+        return n < 0 && errno == EAGAIN ? 1 : 0;
+
+    size_t room = cap - 1 - *len;
+    size_t take = (size_t)n < room ? (size_t)n : room;
+    memcpy(buf + *len, tmp, take);
+    *len += take;
+    buf[*len] = '\0';
+    return 1;
+}
+
+
+
+// Run finder with the strategy's options plus -v on dir.  Threads are
+// sampled every millisecond; a run past the timeout is killed.
+static int run_finder(const char *strategy, const char *dir, const char *target, run_result_t *r) {
+
+    memset(r, 0, sizeof(*r));
+
+    char opts[1024];
+    snprintf(opts, sizeof(opts), "%s", strategy);
+    char *args[MAX_ARGS + 5];
+    int na = 0;
+    args[na++] = (char *)finder;
+    for (char *tok = strtok(opts, " \t"); tok && na < MAX_ARGS; tok = strtok(NULL, " \t")) {
+        args[na++] = tok;
+    }
+    args[na++] = "-v";
+    args[na++] = (char *)dir;
+    args[na++] = (char *)target;
+    args[na] = NULL;
+
+    int out[2], err[2];
+    if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        execv(finder, args);
+        _exit(127);
+    }
+    close(out[1]);
+    close(err[1]);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+
+    static char out_buf[1 << 16], err_buf[1 << 16];
+    size_t out_len = 0, err_len = 0;
+    out_buf[0] = err_buf[0] = '\0';
+
+    int status = 0;
+    struct rusage ru;
+    uint64_t deadline = start + (uint64_t)(timeout_s * 1e9);
+    int open_pipes = 2;
+    while (1) {
+        int threads = read_threads(pid);
+        if (threads > r->max_threads) r->max_threads = threads;
+
+        struct pollfd pfd[2] = { { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 } };
+        if (open_pipes > 0 && poll(pfd, 2, 1) > 0) {
+            if (pfd[0].revents && pfd[0].fd != -1 && !drain(out[0], out_buf, &out_len, sizeof(out_buf))) {
+                close(out[0]);
+                out[0] = -1;
+                open_pipes--;
+            }
+            if (pfd[1].revents && pfd[1].fd != -1 && !drain(err[0], err_buf, &err_len, sizeof(err_buf))) {
+                close(err[0]);
+                err[0] = -1;
+                open_pipes--;
+            }
+        } else if (open_pipes == 0) {
+            usleep(1000);
+        }
+
+        pid_t got = wait4(pid, &status, WNOHANG, &ru);
+        if (got == pid)
+            break;
+        if (now_ns() > deadline) {
+            kill(pid, SIGKILL);
+            wait4(pid, &status, 0, &ru);
+            r->timed_out = 1;
+            break;
+        }
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+    r->max_rss_kb = ru.ru_maxrss;
+
+    // whatever is still buffered in the pipes
+    while (out[0] != -1 && drain(out[0], out_buf, &out_len, sizeof(out_buf))) {}
+    while (err[0] != -1 && drain(err[0], err_buf, &err_len, sizeof(err_buf))) {}
+    if (out[0] != -1) close(out[0]);
+    if (err[0] != -1) close(err[0]);
+
+    const char *line = strstr(err_buf, "Walk: ");
+    int parsed = line && sscanf(line, "Walk: %ld directories, %ld entries, %ld opens, %ld stats, "
+                                      "%ld statx, %ld io_uring_enter, %ld reads, %d workers",
+                                &r->dirs, &r->entries, &r->opens, &r->stats,
+                                &r->statx, &r->enters, &r->reads, &r->workers) == 8;
+    r->found_target = strstr(out_buf, target) != NULL;
+    r->ok = !r->timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0 && parsed;
+
+    if (!r->ok) {
+        fprintf(stderr, "finder %s %s: %s\n", strategy, dir,
+                r->timed_out ? "timed out" : err_buf[0] ? err_buf : "failed");
+    }
+    return 0;
+}
+
+
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+
+    (void)st;
+    (void)ftw;
+    if ((flag == FTW_DP ? rmdir(path) : unlink(path)) != 0) perror(path);
+    return 0;
+}
+
+
+
+// Insertion sort: there are at most MAX_RUNS
+static void sort_seconds(double *secs, int n) {
+
+    for (int i = 1; i < n; i++) {
+        double x = secs[i];
+        int j = i;
+        for (; j > 0 && secs[j - 1] > x; j--) {
+            secs[j] = secs[j - 1];
+        }
+        secs[j] = x;
+    }
+}
@@ -0,0 +1,1124 @@
+// d_type and the DT_* constants
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "daemon.h"
+
+#define NONE INDEX_NONE
+
+// Events are acted on once a burst has been quiet this long...
+#define QUIET_MS 50
+// ...but never later than this after the first one
+#define MAX_DELAY_MS 1000
+// Directories without a watch are checked for a new mtime this often
+#define POLL_MS 5000
+// More changed names than this in one directory: read all of it again
+#define RESCAN_PENDING 256
+// Largest request a client may send
+#define MAX_REQUEST (1 << 20)
+
+// A distinct file name and every file that has it
+typedef struct {
+    char *name;
+    uint32_t next;           // hash chain
+    uint32_t *files;
+    uint32_t nfiles, cap;
+} name_t;
+
+typedef struct {
+    uint32_t dir, name;
+    uint32_t in_name;        // position in names[name].files
+    uint32_t in_dir;         // position in dirs[dir].files
+    uint32_t next;           // hash chain, or free list
+    uint32_t seen;
+} file_t;
+
+typedef struct {
+    uint32_t parent;
+    char *name;
+    int wd;                  // -1: no watch, polled by mtime
+    int alive;
+    uint32_t next;           // (parent, name) hash chain, or free list
+    uint32_t in_parent;      // position in the parent's subs
+    uint32_t seen;
+    int64_t mtime_sec, mtime_nsec;   // mtime_sec -1: never read
+    uint64_t ino;
+    uint32_t *files;
+    uint32_t nfiles, files_cap;
+    uint32_t *subs;
+    uint32_t nsubs, subs_cap;
+
+    // changes waiting for the burst to end
+    char **pending;
+    uint32_t npending, pending_cap;
+    int rescan;              // too many, or unknown: read everything
+    int queued;              // on the dirty list
+} mdir_t;
+
+static struct {
+    char *root;
+    int ifd;
+
+    name_t *names;
+    uint32_t nnames, names_cap;
+    uint32_t *name_hash, name_mask;
+
+    file_t *files;
+    uint32_t nfiles, files_cap, free_file, live_files;
+    uint32_t *file_hash, file_mask;
+
+    mdir_t *dirs;
+    uint32_t ndirs, dirs_cap, free_dir, live_dirs;
+    uint32_t *dir_hash, dir_mask;
+
+    uint32_t *wd_dir;        // watch descriptor -> directory
+    uint32_t wd_cap;
+
+    uint32_t *dirty;
+    uint32_t ndirty, dirty_cap;
+    int overflow;            // events were lost: check every directory
+    int poll;                // some directories have no watch
+
+    uint32_t gen;
+} st;
+
+static volatile sig_atomic_t stop;
+
+static int grow(void *arr, uint32_t *cap, uint32_t need, size_t size);
+static uint32_t hash_str(uint32_t seed, const char *s);
+static int rehash(uint32_t **table, uint32_t *mask, uint32_t count);
+static uint32_t name_find(const char *name, int create);
+static uint32_t file_find(uint32_t dir, uint32_t name);
+static int file_add(uint32_t dir, const char *name);
+static void file_remove(uint32_t f);
+static uint32_t dir_find(uint32_t parent, const char *name);
+static uint32_t dir_new(uint32_t parent, const char *name);
+static void dir_remove(uint32_t d);
+static char *dir_path(uint32_t d, const char *name);
+static void set_watch(uint32_t d, int wd);
+static void dir_scan(uint32_t d);
+static void check_name(uint32_t d, int dfd, const char *name);
+static void mark_dirty(uint32_t d, const char *name);
+static void flush(void);
+static void check_mtimes(int all);
+static void read_events(void);
+static int load(index_builder_t *b);
+static void serve_client(int cfd);
+static void on_signal(int sig);
+static long now_ms(void);
+
+
+
+// Watch a directory we already have open; inotify takes no *at variant,
+// but the descriptor's /proc link resolves to the same directory.
+int watch_dir(int ifd, int dfd) {
+
+    static int warned;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", dfd);
+
+    int wd = inotify_add_watch(ifd, path, WATCH_MASK);
+    if (wd == -1 && errno == ENOSPC && !warned) {
+        warned = 1;
+        fprintf(stderr, "inotify watch limit reached; directories without a watch are "
+                        "checked every %d s\n", POLL_MS / 1000);
+    }
+    return wd;
+}
+
+
+
+int daemon_run(const char *sock_path, const char *root, index_builder_t *b, int ifd) {
+
+    st.root = strdup(root);
+    st.ifd = ifd;
+    st.free_file = st.free_dir = NONE;
+    if (!st.root || load(b) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    builder_free(b);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", sock_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    unlink(sock_path);
+    if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(lfd, 64) == -1) {
+        perror(sock_path);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = lfd };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+    ev.data.fd = ifd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ifd, &ev);
+
+    fprintf(stderr, "Watching %s: %u directories, %u files; queries on %s\n",
+            st.root, st.live_dirs, st.live_files, sock_path);
+
+    // events that arrived during the initial walk
+    read_events();
+
+    long first_change = 0, last_change = 0, last_poll = now_ms();
+    while (!stop) {
+
+        // sleep until the burst is over, the deadline for it passes, or
+        // it is time to poll unwatched directories
+        long now = now_ms();
+        int timeout = -1;
+        if (st.ndirty || st.overflow) {
+            long quiet = last_change + QUIET_MS - now;
+            long deadline = first_change + MAX_DELAY_MS - now;
+            long t = quiet < deadline ? quiet : deadline;
+            timeout = t > 0 ? (int)t : 0;
+        } else if (st.poll) {
+            long t = last_poll + POLL_MS - now;
+            timeout = t > 0 ? (int)t : 0;
+        }
+
+        struct epoll_event events[16];
+        int n = epoll_wait(epfd, events, 16, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == ifd) {
+                int had = st.ndirty || st.overflow;
+                read_events();
+                now = now_ms();
+                if (!had) first_change = now;
+                last_change = now;
+            } else {
+                int cfd = accept(lfd, NULL, NULL);
+                if (cfd != -1) {
+                    // answers reflect every event received so far
+                    read_events();
+                    flush();
+                    serve_client(cfd);
+                    close(cfd);
+                }
+            }
+        }
+
+        now = now_ms();
+        if ((st.ndirty || st.overflow) &&
+            (now - last_change >= QUIET_MS || now - first_change >= MAX_DELAY_MS)) {
+            flush();
+        }
+        if (st.poll && now - last_poll >= POLL_MS) {
+            check_mtimes(0);
+            last_poll = now;
+        }
+    }
+
+    close(epfd);
+    close(lfd);
+    unlink(sock_path);
+    return 0;
+}
+
+
+
+// Send the patterns of m, print what comes back
+int daemon_query(const char *sock_path, const matcher_t *m, const char *under,
+                 void (*found)(void *arg, const char *path), void *arg) {
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(sock_path);
+        if (fd != -1) close(fd);
+        return 1;
+    }
+
+    FILE *out = fdopen(dup(fd), "w");
+    if (!out) {
+        perror("fdopen");
+        close(fd);
+        return 1;
+    }
+    if (m->icase) fputc('i', out), fputc('\0', out);
+    fprintf(out, "u%s%c", under, '\0');
+    for (int i = 0; i < m->npatterns; i++) {
+        char kind = m->patterns[i].kind == MATCH_GLOB ? 'g' :
+                    m->patterns[i].kind == MATCH_REGEX ? 'r' : 'e';
+        fprintf(out, "%c%s%c", kind, m->patterns[i].text, '\0');
+    }
+    fputc('\0', out);
+    if (fclose(out) != 0) {
+        perror(sock_path);
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        perror("fdopen");
+        close(fd);
+        return 1;
+    }
+
+    int rc = 0;
+    char *item = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getdelim(&item, &cap, '\0', in)) > 0) {
+        if (item[0] == '!') {
+            fprintf(stderr, "Error: %s\n", item + 1);
+            rc = 1;
+        } else {
+            found(arg, item);
+        }
+    }
+    free(item);
+    fclose(in);
+    return rc;
+}
+
+
+
+//  STORE
+
+static int grow(void *arr, uint32_t *cap, uint32_t need, size_t size) {
+
+    if (need <= *cap)
+        return 0;
+
+    uint32_t new_cap = *cap ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+    void *tmp = realloc(*(void **)arr, (size_t)new_cap * size);
+    if (!tmp)
+        return -1;
+    *(void **)arr = tmp;
+    *cap = new_cap;
+    return 0;
+}
+
+
+
+static uint32_t hash_str(uint32_t seed, const char *s) {
+    uint32_t h = 2166136261u ^ seed;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_file(uint32_t dir, uint32_t name) {
+    uint64_t k = ((uint64_t)dir << 32 | name) * 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(k >> 32);
+}
+
+
+
+// Keep a chained table at most one entry per bucket.  The chains are
+// rebuilt by the caller; this only swaps in a bigger empty table.
+static int rehash(uint32_t **table, uint32_t *mask, uint32_t count) {
+
+    if (*table && count <= *mask + 1)
+        return 0;
+
+    uint32_t size = *table ? (*mask + 1) * 2 : 1024;
+    uint32_t *t = malloc(size * sizeof(uint32_t));
+    if (!t)
+        return -1;
+    memset(t, 0xff, size * sizeof(uint32_t));
+    free(*table);
+    *table = t;
+    *mask = size - 1;
+    return 1;
+}
+
+
+
+static uint32_t name_find(const char *name, int create) {
+
+    uint32_t h = hash_str(0, name);
+    if (st.name_hash) {
+        for (uint32_t n = st.name_hash[h & st.name_mask]; n != NONE; n = st.names[n].next) {
+            if (strcmp(st.names[n].name, name) == 0)
+                return n;
+        }
+    }
+    if (!create)
+        return NONE;
+
+    if (grow(&st.names, &st.names_cap, st.nnames + 1, sizeof(name_t)) != 0)
+        return NONE;
+    char *copy = strdup(name);
+    if (!copy)
+        return NONE;
+
+    uint32_t n = st.nnames++;
+    memset(&st.names[n], 0, sizeof(name_t));
+    st.names[n].name = copy;
+
+    int r = rehash(&st.name_hash, &st.name_mask, st.nnames);
+    if (r < 0)
+        return NONE;
+    if (r > 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t b = hash_str(0, st.names[i].name) & st.name_mask;
+            st.names[i].next = st.name_hash[b];
+            st.name_hash[b] = i;
+        }
+    }
+    uint32_t b = h & st.name_mask;
+    st.names[n].next = st.name_hash[b];
+    st.name_hash[b] = n;
+    return n;
+}
+
+
+
+static uint32_t file_find(uint32_t dir, uint32_t name) {
+
+    if (!st.file_hash)
+        return NONE;
+    for (uint32_t f = st.file_hash[hash_file(dir, name) & st.file_mask]; f != NONE; f = st.files[f].next) {
+        if (st.files[f].dir == dir && st.files[f].name == name)
+            return f;
+    }
+    return NONE;
+}
+
+
+
+static int file_add(uint32_t dir, const char *name) {
+
+    uint32_t n = name_find(name, 1);
+    if (n == NONE)
+        return -1;
+
+    uint32_t f = file_find(dir, n);
+    if (f != NONE) {
+        st.files[f].seen = st.gen;
+        return 0;
+    }
+
+    if (grow(&st.names[n].files, &st.names[n].cap, st.names[n].nfiles + 1, sizeof(uint32_t)) != 0 ||
+        grow(&st.dirs[dir].files, &st.dirs[dir].files_cap, st.dirs[dir].nfiles + 1, sizeof(uint32_t)) != 0)
+        return -1;
+
+    if (st.free_file != NONE) {
+        f = st.free_file;
+        st.free_file = st.files[f].next;
+    } else {
+        if (grow(&st.files, &st.files_cap, st.nfiles + 1, sizeof(file_t)) != 0)
+            return -1;
+        f = st.nfiles++;
+    }
+    st.live_files++;
+
+    file_t *rec = &st.files[f];
+    rec->dir = dir;
+    rec->name = n;
+    rec->seen = st.gen;
+    rec->in_name = st.names[n].nfiles;
+    st.names[n].files[st.names[n].nfiles++] = f;
+    rec->in_dir = st.dirs[dir].nfiles;
+    st.dirs[dir].files[st.dirs[dir].nfiles++] = f;
+
+    int r = rehash(&st.file_hash, &st.file_mask, st.live_files);
+    if (r < 0)
+        return -1;
+    if (r > 0) {
+        // rebuild the chains from the per-directory lists
+        for (uint32_t d = 0; d < st.ndirs; d++) {
+            for (uint32_t i = 0; st.dirs[d].alive && i < st.dirs[d].nfiles; i++) {
+                uint32_t g = st.dirs[d].files[i];
+                uint32_t b = hash_file(d, st.files[g].name) & st.file_mask;
+                st.files[g].next = st.file_hash[b];
+                st.file_hash[b] = g;
+            }
+        }
+    } else {
+        uint32_t b = hash_file(dir, n) & st.file_mask;
+        rec->next = st.file_hash[b];
+        st.file_hash[b] = f;
+    }
+    return 0;
+}
+
+
+
+static void file_remove(uint32_t f) {
+
+    file_t *rec = &st.files[f];
+
+    name_t *n = &st.names[rec->name];
+    uint32_t last = n->files[--n->nfiles];
+    n->files[rec->in_name] = last;
+    st.files[last].in_name = rec->in_name;
+
+    mdir_t *d = &st.dirs[rec->dir];
+    last = d->files[--d->nfiles];
+    d->files[rec->in_dir] = last;
+    st.files[last].in_dir = rec->in_dir;
+
+    uint32_t *link = &st.file_hash[hash_file(rec->dir, rec->name) & st.file_mask];
+    while (*link != f) link = &st.files[*link].next;
+    *link = rec->next;
+
+    rec->next = st.free_file;
+    st.free_file = f;
+    st.live_files--;
+}
+
+
+
+static uint32_t dir_find(uint32_t parent, const char *name) {
+
+    if (!st.dir_hash)
+        return NONE;
+    for (uint32_t d = st.dir_hash[hash_str(parent, name) & st.dir_mask]; d != NONE; d = st.dirs[d].next) {
+        if (st.dirs[d].parent == parent && strcmp(st.dirs[d].name, name) == 0)
+            return d;
+    }
+    return NONE;
+}
+
+
+
+// A directory entry, not yet read; parent is NONE for the root
+static uint32_t dir_new(uint32_t parent, const char *name) {
+
+    char *copy = strdup(name);
+    if (!copy)
+        return NONE;
+    if (parent != NONE &&
+        grow(&st.dirs[parent].subs, &st.dirs[parent].subs_cap, st.dirs[parent].nsubs + 1, sizeof(uint32_t)) != 0) {
+        free(copy);
+        return NONE;
+    }
+
+    uint32_t d;
+    if (st.free_dir != NONE) {
+        d = st.free_dir;
+        st.free_dir = st.dirs[d].next;
+    } else {
+        if (grow(&st.dirs, &st.dirs_cap, st.ndirs + 1, sizeof(mdir_t)) != 0) {
+            free(copy);
+            return NONE;
+        }
+        d = st.ndirs++;
+    }
+    st.live_dirs++;
+
+    mdir_t *rec = &st.dirs[d];
+    memset(rec, 0, sizeof(*rec));
+    rec->parent = parent;
+    rec->name = copy;
+    rec->wd = -1;
+    rec->alive = 1;
+    rec->seen = st.gen;
+    rec->mtime_sec = -1;
+    if (parent != NONE) {
+        rec->in_parent = st.dirs[parent].nsubs;
+        st.dirs[parent].subs[st.dirs[parent].nsubs++] = d;
+    }
+
+    int r = rehash(&st.dir_hash, &st.dir_mask, st.live_dirs);
+    if (r > 0) {
+        for (uint32_t i = 0; i < st.ndirs; i++) {
+            if (!st.dirs[i].alive || i == d)
+                continue;
+            uint32_t b = hash_str(st.dirs[i].parent, st.dirs[i].name) & st.dir_mask;
+            st.dirs[i].next = st.dir_hash[b];
+            st.dir_hash[b] = i;
+        }
+    }
+    if (r >= 0) {
+        uint32_t b = hash_str(parent, name) & st.dir_mask;
+        rec->next = st.dir_hash[b];
+        st.dir_hash[b] = d;
+    }
+    return d;
+}
+
+
+
+static void dir_remove(uint32_t d) {
+
+    while (st.dirs[d].nsubs > 0) {
+        dir_remove(st.dirs[d].subs[st.dirs[d].nsubs - 1]);
+    }
+    while (st.dirs[d].nfiles > 0) {
+        file_remove(st.dirs[d].files[st.dirs[d].nfiles - 1]);
+    }
+
+    mdir_t *rec = &st.dirs[d];
+    if (rec->wd >= 0 && st.wd_dir[rec->wd] == d) {
+        inotify_rm_watch(st.ifd, rec->wd);
+        st.wd_dir[rec->wd] = NONE;
+    }
+
+    if (rec->parent != NONE) {
+        mdir_t *p = &st.dirs[rec->parent];
+        uint32_t last = p->subs[--p->nsubs];
+        p->subs[rec->in_parent] = last;
+        st.dirs[last].in_parent = rec->in_parent;
+    }
+
+    uint32_t *link = &st.dir_hash[hash_str(rec->parent, rec->name) & st.dir_mask];
+    while (*link != d) link = &st.dirs[*link].next;
+    *link = rec->next;
+
+    for (uint32_t i = 0; i < rec->npending; i++) {
+        free(rec->pending[i]);
+    }
+    free(rec->pending);
+    free(rec->name);
+    free(rec->files);
+    free(rec->subs);
+    memset(rec, 0, sizeof(*rec));
+
+    rec->next = st.free_dir;
+    st.free_dir = d;
+    st.live_dirs--;
+}
+
+
+
+// "<root>/<dir>/.../<name>"; name may be NULL
+static char *dir_path(uint32_t d, const char *name) {
+
+    size_t len = strlen(st.root) + (name ? strlen(name) + 1 : 0);
+    for (uint32_t i = d; st.dirs[i].parent != NONE; i = st.dirs[i].parent) {
+        len += strlen(st.dirs[i].name) + 1;
+    }
+
+    char *path = malloc(len + 1);
+    if (!path)
+        return NULL;
+
+    char *p = path + len;
+    *p = '\0';
+    if (name) {
+        size_t n = strlen(name);
+        p -= n;
+        memcpy(p, name, n);
+        *--p = '/';
+    }
+    for (uint32_t i = d; st.dirs[i].parent != NONE; i = st.dirs[i].parent) {
+        size_t n = strlen(st.dirs[i].name);
+        p -= n;
+        memcpy(p, st.dirs[i].name, n);
+        *--p = '/';
+    }
+    memcpy(path, st.root, strlen(st.root));
+
+    // a root of "/" already ends in the separator
+    if (strcmp(st.root, "/") == 0 && len > 1) {
+        memmove(path, path + 1, len);
+    }
+    return path;
+}
+
+
+
+static void set_watch(uint32_t d, int wd) {
+
+    if (wd < 0) {
+        st.dirs[d].wd = -1;
+        st.poll = 1;
+        return;
+    }
+    uint32_t old_cap = st.wd_cap;
+    if (grow(&st.wd_dir, &st.wd_cap, wd + 1, sizeof(uint32_t)) != 0) {
+        inotify_rm_watch(st.ifd, wd);
+        st.dirs[d].wd = -1;
+        st.poll = 1;
+        return;
+    }
+    for (uint32_t i = old_cap; i < st.wd_cap; i++) {
+        st.wd_dir[i] = NONE;
+    }
+
+    // the same inode watched from an old place (a moved directory whose
+    // removal is still pending) hands the watch over
+    uint32_t old = st.wd_dir[wd];
+    if (old != NONE && old != d && old < st.ndirs && st.dirs[old].alive && st.dirs[old].wd == wd) {
+        st.dirs[old].wd = -1;
+    }
+    st.wd_dir[wd] = d;
+    st.dirs[d].wd = wd;
+}
+
+
+
+// Regular files, and links to them, are files; only real directories are
+// entered, as in the walk
+static int entry_type(int dfd, const char *name, int type) {
+
+    struct stat sb;
+    if (type == DT_UNKNOWN) {
+        if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+            return DT_UNKNOWN;
+        type = S_ISREG(sb.st_mode) ? DT_REG : S_ISDIR(sb.st_mode) ? DT_DIR :
+               S_ISLNK(sb.st_mode) ? DT_LNK : DT_UNKNOWN;
+    }
+    if (type == DT_LNK && fstatat(dfd, name, &sb, 0) == 0 && S_ISREG(sb.st_mode))
+        return DT_REG;
+    return type;
+}
+
+
+
+// Read directory d again: add what is new, drop what is gone, and read
+// the subdirectories that appeared
+static void dir_scan(uint32_t d) {
+
+    char *path = dir_path(d, NULL);
+    int fd = path ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+    free(path);
+    if (fd == -1)
+        return;         // gone; the change in its parent removes it
+
+    if (st.dirs[d].wd < 0) set_watch(d, watch_dir(st.ifd, fd));
+
+    struct stat sb;
+    if (fstat(fd, &sb) == 0) {
+        st.dirs[d].mtime_sec = sb.st_mtim.tv_sec;
+        st.dirs[d].mtime_nsec = sb.st_mtim.tv_nsec;
+        st.dirs[d].ino = sb.st_ino;
+    }
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    uint32_t gen = ++st.gen;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        int type = entry_type(dirfd(dir), name, entry->d_type);
+        if (type == DT_REG) {
+            file_add(d, name);
+        } else if (type == DT_DIR) {
+            uint32_t sub = dir_find(d, name);
+            if (sub == NONE) sub = dir_new(d, name);
+            if (sub != NONE) st.dirs[sub].seen = gen;
+        }
+    }
+    closedir(dir);
+
+    // backwards, so the swap in file_remove only moves visited entries
+    for (uint32_t i = st.dirs[d].nfiles; i > 0; i--) {
+        uint32_t f = st.dirs[d].files[i - 1];
+        if (st.files[f].seen != gen) file_remove(f);
+    }
+    for (uint32_t i = st.dirs[d].nsubs; i > 0; i--) {
+        uint32_t sub = st.dirs[d].subs[i - 1];
+        if (st.dirs[sub].seen != gen) dir_remove(sub);
+    }
+    for (uint32_t i = 0; i < st.dirs[d].nsubs; i++) {
+        uint32_t sub = st.dirs[d].subs[i];
+        if (st.dirs[sub].mtime_sec == -1) dir_scan(sub);
+    }
+}
+
+
+
+// One name in directory d changed: bring the store in line with what is
+// there now
+static void check_name(uint32_t d, int dfd, const char *name) {
+
+    struct stat sb;
+    int type = DT_UNKNOWN;
+    if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        type = S_ISREG(sb.st_mode) ? DT_REG : S_ISDIR(sb.st_mode) ? DT_DIR :
+               S_ISLNK(sb.st_mode) ? entry_type(dfd, name, DT_LNK) : DT_UNKNOWN;
+    }
+
+    uint32_t n = name_find(name, 0);
+    uint32_t f = n == NONE ? NONE : file_find(d, n);
+    if (type == DT_REG && f == NONE) {
+        file_add(d, name);
+    } else if (type != DT_REG && f != NONE) {
+        file_remove(f);
+    }
+
+    // a directory replaced by another of the same name is a new one
+    uint32_t sub = dir_find(d, name);
+    if (sub != NONE && (type != DT_DIR || st.dirs[sub].ino != (uint64_t)sb.st_ino)) {
+        dir_remove(sub);
+        sub = NONE;
+    }
+    if (type == DT_DIR && sub == NONE) {
+        sub = dir_new(d, name);
+        if (sub != NONE) dir_scan(sub);
+    }
+}
+
+
+
+//  EVENTS
+
+static void mark_dirty(uint32_t d, const char *name) {
+
+    mdir_t *rec = &st.dirs[d];
+    if (!rec->queued) {
+        if (grow(&st.dirty, &st.dirty_cap, st.ndirty + 1, sizeof(uint32_t)) != 0) {
+            st.overflow = 1;
+            return;
+        }
+        st.dirty[st.ndirty++] = d;
+        rec->queued = 1;
+    }
+
+    if (rec->rescan)
+        return;
+    if (name && rec->npending > 0 && strcmp(rec->pending[rec->npending - 1], name) == 0)
+        return;
+
+    char *copy = name ? strdup(name) : NULL;
+    if (!copy || rec->npending >= RESCAN_PENDING ||
+        grow(&rec->pending, &rec->pending_cap, rec->npending + 1, sizeof(char *)) != 0) {
+        // past this many names one readdir is cheaper than a stat for each
+        free(copy);
+        for (uint32_t i = 0; i < rec->npending; i++) {
+            free(rec->pending[i]);
+        }
+        rec->npending = 0;
+        rec->rescan = 1;
+        return;
+    }
+    rec->pending[rec->npending++] = copy;
+}
+
+
+
+// Apply everything the last burst of events touched
+static void flush(void) {
+
+    if (st.overflow) {
+        // the kernel dropped events, so nothing says which directories
+        // changed: compare every mtime and read only those that moved on
+        st.overflow = 0;
+        check_mtimes(1);
+    }
+
+    for (uint32_t i = 0; i < st.ndirty; i++) {
+        uint32_t d = st.dirty[i];
+        if (!st.dirs[d].alive || !st.dirs[d].queued)
+            continue;
+        st.dirs[d].queued = 0;
+
+        if (st.dirs[d].rescan) {
+            st.dirs[d].rescan = 0;
+            dir_scan(d);
+            continue;
+        }
+
+        char *path = dir_path(d, NULL);
+        int fd = path ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        free(path);
+        for (uint32_t j = 0; j < st.dirs[d].npending; j++) {
+            if (fd != -1) check_name(d, fd, st.dirs[d].pending[j]);
+            free(st.dirs[d].pending[j]);
+        }
+        st.dirs[d].npending = 0;
+
+        struct stat sb;
+        if (fd != -1 && fstat(fd, &sb) == 0) {
+            st.dirs[d].mtime_sec = sb.st_mtim.tv_sec;
+            st.dirs[d].mtime_nsec = sb.st_mtim.tv_nsec;
+        }
+        if (fd != -1) close(fd);
+    }
+    st.ndirty = 0;
+}
+
+
+
+// Read again every directory (all) or every unwatched one whose mtime or
+// inode is not what we last saw
+static void check_mtimes(int all) {
+
+    int unwatched = 0;
+    uint32_t n = st.ndirs;
+    for (uint32_t d = 0; d < n; d++) {
+        if (!st.dirs[d].alive || (!all && st.dirs[d].wd >= 0))
+            continue;
+
+        struct stat sb;
+        char *path = dir_path(d, NULL);
+        int ok = path && lstat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+        free(path);
+
+        if (ok && (sb.st_mtim.tv_sec != st.dirs[d].mtime_sec ||
+                   sb.st_mtim.tv_nsec != st.dirs[d].mtime_nsec ||
+                   (uint64_t)sb.st_ino != st.dirs[d].ino)) {
+            dir_scan(d);
+        }
+        if (st.dirs[d].alive && st.dirs[d].wd < 0) unwatched = 1;
+    }
+    if (all || !unwatched) st.poll = unwatched;
+}
+
+
+
+static void read_events(void) {
+
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(st.ifd, buf, sizeof(buf));
+        if (len <= 0)
+            return;
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                st.overflow = 1;
+                continue;
+            }
+            if (ev->wd < 0 || (uint32_t)ev->wd >= st.wd_cap || st.wd_dir[ev->wd] == NONE)
+                continue;
+            uint32_t d = st.wd_dir[ev->wd];
+
+            if (ev->mask & IN_IGNORED) {
+                st.wd_dir[ev->wd] = NONE;
+                if (st.dirs[d].wd == ev->wd) {
+                    st.dirs[d].wd = -1;
+                    st.poll = 1;
+                }
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // the parent sees this by name too, unless it has no watch
+                if (st.dirs[d].parent != NONE) mark_dirty(st.dirs[d].parent, st.dirs[d].name);
+                continue;
+            }
+            mark_dirty(d, ev->len ? ev->name : NULL);
+        }
+    }
+}
+
+
+
+// Take over what the initial walk recorded
+static int load(index_builder_t *b) {
+
+    uint32_t max_id = 0;
+    for (int i = 0; i < b->nparts; i++) {
+        for (size_t j = 0; j < b->parts[i].ndirs; j++) {
+            if (b->parts[i].dirs[j].id + 1 > max_id) max_id = b->parts[i].dirs[j].id + 1;
+        }
+    }
+
+    // ids grow down the tree, so a parent is always placed before its children
+    build_dir_t **by_id = calloc(max_id ? max_id : 1, sizeof(build_dir_t *));
+    const char **dir_str = calloc(max_id ? max_id : 1, sizeof(char *));
+    uint32_t *map = malloc((max_id ? max_id : 1) * sizeof(uint32_t));
+    int ok = by_id && dir_str && map ? 0 : -1;
+
+    for (int i = 0; ok == 0 && i < b->nparts; i++) {
+        build_part_t *p = &b->parts[i];
+        for (size_t j = 0; j < p->ndirs; j++) {
+            by_id[p->dirs[j].id] = &p->dirs[j];
+            dir_str[p->dirs[j].id] = p->strings + p->dirs[j].name;
+        }
+    }
+
+    for (uint32_t id = 0; ok == 0 && id < max_id; id++) {
+        build_dir_t *bd = by_id[id];
+        map[id] = NONE;
+        if (!bd)
+            continue;
+        uint32_t parent = bd->parent == INDEX_NONE ? NONE : map[bd->parent];
+        if (bd->parent != INDEX_NONE && parent == NONE)
+            continue;
+
+        uint32_t d = dir_new(parent, dir_str[id]);
+        if (d == NONE) {
+            ok = -1;
+            break;
+        }
+        st.dirs[d].mtime_sec = bd->mtime_sec;
+        st.dirs[d].mtime_nsec = bd->mtime_nsec;
+        st.dirs[d].ino = bd->ino;
+        set_watch(d, bd->wd);
+        map[id] = d;
+    }
+
+    for (int i = 0; ok == 0 && i < b->nparts; i++) {
+        build_part_t *p = &b->parts[i];
+        for (size_t j = 0; ok == 0 && j < p->nfiles; j++) {
+            uint32_t d = p->files[j].dir < max_id ? map[p->files[j].dir] : NONE;
+            if (d != NONE) ok = file_add(d, p->strings + p->files[j].name);
+        }
+    }
+
+    free(by_id);
+    free(dir_str);
+    free(map);
+    return ok;
+}
+
+
+
+//  QUERIES
+
+typedef struct {
+    int fd;
+    const char *under;
+    size_t under_len;
+    size_t used;
+    char buf[65536];
+} reply_t;
+
+static void reply(reply_t *r, const char *s, size_t len) {
+
+    if (r->used + len + 1 > sizeof(r->buf) || !s) {
+        size_t off = 0;
+        while (off < r->used) {
+            ssize_t n = write(r->fd, r->buf + off, r->used - off);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+        r->used = 0;
+    }
+    if (!s || len + 1 > sizeof(r->buf))
+        return;
+    memcpy(r->buf + r->used, s, len + 1);
+    r->used += len + 1;
+}
+
+static void emit_files(reply_t *r, uint32_t n) {
+
+    for (uint32_t i = 0; i < st.names[n].nfiles; i++) {
+        char *path = dir_path(st.files[st.names[n].files[i]].dir, st.names[n].name);
+        if (!path)
+            continue;
+        if (strncmp(path, r->under, r->under_len) == 0 &&
+            (path[r->under_len] == '/' || r->under_len == 1)) {
+            reply(r, path, strlen(path));
+        }
+        free(path);
+    }
+}
+
+
+
+static void serve_client(int cfd) {
+
+    struct timeval tv = { .tv_sec = 2 };
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // the request ends with an empty string, or when the client shuts down
+    char *req = NULL;
+    uint32_t len = 0, cap = 0;
+    for (;;) {
+        if (grow(&req, &cap, len + 4096, 1) != 0)
+            break;
+        ssize_t n = recv(cfd, req + len, cap - len - 1, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        if ((len >= 2 && req[len - 1] == '\0' && req[len - 2] == '\0') || len > MAX_REQUEST)
+            break;
+    }
+    if (!req)
+        return;
+    req[len] = '\0';
+
+    reply_t *r = malloc(sizeof(reply_t));
+    if (!r) {
+        free(req);
+        return;
+    }
+    matcher_t m;
+    memset(&m, 0, sizeof(m));
+    int icase = 0, ok = 1;
+    const char *under = "/";
+    for (char *p = req; ok && p < req + len && *p; p += strlen(p) + 1) {
+        switch (p[0]) {
+            case 'i': icase = 1; break;
+            case 'u': under = p + 1; break;
+            case 'e': ok = matcher_add(&m, p + 1, MATCH_EXACT) == 0; break;
+            case 'g': ok = matcher_add(&m, p + 1, MATCH_GLOB) == 0; break;
+            case 'r': ok = matcher_add(&m, p + 1, MATCH_REGEX) == 0; break;
+            default: ok = 0;
+        }
+    }
+
+    r->fd = cfd;
+    r->used = 0;
+    r->under = under;
+    r->under_len = strlen(under);
+    if (!ok || m.npatterns == 0 || matcher_compile(&m, icase, 1) != 0) {
+        reply(r, "!bad request", strlen("!bad request"));
+    } else if (m.names && !m.icase && m.nglobs == 0 && m.nalways == 0 && !m.has_regex) {
+        for (uint32_t i = 0; i <= m.names_mask; i++) {
+            uint32_t n = m.names[i] ? name_find(m.names[i], 0) : NONE;
+            if (n != NONE) emit_files(r, n);
+        }
+    } else {
+        for (uint32_t n = 0; n < st.nnames; n++) {
+            if (st.names[n].nfiles && matcher_match(&m, 0, st.names[n].name, strlen(st.names[n].name)))
+                emit_files(r, n);
+        }
+    }
+
+    reply(r, NULL, 0);
+    matcher_free(&m);
+    free(r);
+    free(req);
+}
+
+
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
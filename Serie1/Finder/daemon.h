@@ -0,0 +1,28 @@
+// Finder daemon (-D): keeps every file name of a tree in memory, kept
+// current through inotify, and answers queries (-S) on a Unix socket.
+//
+// Requests and replies are sequences of NUL-terminated strings, so any
+// file name can travel.  A request is
+//     "i"                ignore case (optional)
+//     "u<dir>"           only files under this absolute directory
+//     "e<name>" / "g<glob>" / "r<regex>"   one per pattern
+//     ""                 end of request
+// and the reply is one path per string, or a single "!<error>".
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <sys/inotify.h>
+
+#include "index.h"
+#include "match.h"
+
+// no IN_DONT_FOLLOW: watches are added through /proc/self/fd links
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                    IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+int watch_dir(int ifd, int dfd);
+int daemon_run(const char *sock_path, const char *root, index_builder_t *b, int ifd);
+int daemon_query(const char *sock_path, const matcher_t *m, const char *under,
+                 void (*found)(void *arg, const char *path), void *arg);
+
+#endif
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pwd.h>
+
+#include "filter.h"
+
+static int parse_number(const char *text, const char *units, const long long *scale, long long *out);
+
+
+
+void filter_init(filter_t *f) {
+
+    memset(f, 0, sizeof(*f));
+    f->size_max = (off_t)INT64_MAX;
+    f->mtime_min = (time_t)INT64_MIN;
+    f->mtime_max = (time_t)INT64_MAX;
+}
+
+
+
+// "f", "d", "l" or several at once, e.g. "fd"
+int filter_add_type(filter_t *f, const char *types) {
+
+    for (const char *t = types; *t; t++) {
+        switch (*t) {
+        case 'f': f->types |= FILTER_FILE; break;
+        case 'd': f->types |= FILTER_DIR; break;
+        case 'l': f->types |= FILTER_LINK; break;
+        default:
+            fprintf(stderr, "Error: unknown type '%c' (use f, d or l)\n", *t);
+            return -1;
+        }
+    }
+    return types[0] ? 0 : -1;
+}
+
+
+
+// Digits followed by at most one unit letter
+static int parse_number(const char *text, const char *units, const long long *scale, long long *out) {
+
+    char *end;
+    long long n = strtoll(text, &end, 10);
+    if (end == text || n < 0)
+        return -1;
+
+    if (*end) {
+        const char *u = strchr(units, *end);
+        if (!u || end[1] != '\0')
+            return -1;
+        n *= scale[u - units];
+    }
+    *out = n;
+    return 0;
+}
+
+
+
+// "+N" larger than N, "-N" smaller than N, "N" exactly N bytes; k, M, G
+// multiply.  Repeated filters narrow each other.
+int filter_add_size(filter_t *f, const char *text) {
+
+    static const long long scale[] = { 1, 1 << 10, 1 << 10, 1 << 20, 1 << 20, 1 << 30, 1 << 30 };
+    char sign = (text[0] == '+' || text[0] == '-') ? text[0] : 0;
+    long long n;
+    if (parse_number(text + (sign != 0), "ckKmMgG", scale, &n) != 0) {
+        fprintf(stderr, "Error: bad size '%s'\n", text);
+        return -1;
+    }
+
+    if (sign != '-' && (sign ? n + 1 : n) > f->size_min) f->size_min = sign ? n + 1 : n;
+    if (sign != '+' && (sign ? n - 1 : n) < f->size_max) f->size_max = sign ? n - 1 : n;
+    f->has_meta = 1;
+    return 0;
+}
+
+
+
+// "-2h" modified within the last two hours, "+30d" more than 30 days
+// ago; s, m, h and d, days when there is no unit.
+int filter_add_mtime(filter_t *f, const char *text) {
+
+    static const long long scale[] = { 1, 60, 3600, 86400 };
+    char sign = text[0];
+    long long n;
+    size_t len = strlen(text);
+    int bare = len > 1 && text[len - 1] >= '0' && text[len - 1] <= '9';
+    if ((sign != '+' && sign != '-') || parse_number(text + 1, "smhd", scale, &n) != 0) {
+        fprintf(stderr, "Error: bad time '%s' (e.g. -2h, +30d)\n", text);
+        return -1;
+    }
+    if (bare) n *= 86400;
+
+    time_t edge = time(NULL) - (time_t)n;
+    if (sign == '-' && edge > f->mtime_min) f->mtime_min = edge;
+    if (sign == '+' && edge < f->mtime_max) f->mtime_max = edge;
+    f->has_meta = 1;
+    return 0;
+}
+
+
+
+// A user name or a numeric uid
+int filter_set_owner(filter_t *f, const char *owner) {
+
+    struct passwd *pw = getpwnam(owner);
+    if (pw) {
+        f->uid = pw->pw_uid;
+    } else {
+        char *end;
+        unsigned long uid = strtoul(owner, &end, 10);
+        if (end == owner || *end != '\0') {
+            fprintf(stderr, "Error: unknown user '%s'\n", owner);
+            return -1;
+        }
+        f->uid = (uid_t)uid;
+    }
+    f->has_uid = 1;
+    f->has_meta = 1;
+    return 0;
+}
+
+
+
+int filter_add_prune(filter_t *f, const char *name) {
+
+    if (f->nprune == f->cap) {
+        int new_cap = (f->cap == 0 ? 8 : f->cap * 2);
+        char **tmp = realloc(f->prune, new_cap * sizeof(char *));
+        if (!tmp) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        f->prune = tmp;
+        f->cap = new_cap;
+    }
+
+    f->prune[f->nprune] = strdup(name);
+    if (!f->prune[f->nprune]) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    f->nprune++;
+    return 0;
+}
+
+
+
+// Anything beyond the default of regular files, without pruning
+int filter_active(const filter_t *f) {
+    return f->types || f->has_meta || f->nprune || f->xdev;
+}
+
+
+
+int filter_match(const filter_t *f, const meta_t *m) {
+
+    if (m->size < f->size_min || m->size > f->size_max)
+        return 0;
+    if (m->mtime < f->mtime_min || m->mtime > f->mtime_max)
+        return 0;
+    if (f->has_uid && m->uid != f->uid)
+        return 0;
+    return 1;
+}
+
+
+
+int filter_pruned(const filter_t *f, const char *name) {
+
+    for (int i = 0; i < f->nprune; i++) {
+        if (fnmatch(f->prune[i], name, FNM_PERIOD) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+
+void filter_free(filter_t *f) {
+
+    for (int i = 0; i < f->nprune; i++) {
+        free(f->prune[i]);
+    }
+    free(f->prune);
+    f->prune = NULL;
+    f->nprune = f->cap = 0;
+}
+
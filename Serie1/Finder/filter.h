@@ -0,0 +1,53 @@
+// Metadata filters and pruning rules for the walk.
+//
+// Filters (-t type, -z size, -T mtime, -o owner) are tested on what the
+// walk already knows: the entry type from readdir and, only for names
+// that matched and only when a size, time or owner filter asks for it,
+// one stat.  Prune rules (-P name, -x) stop descent before a directory is
+// even opened.  With -L, links to directories are followed; a directory
+// that is one of its own ancestors (a link back up the tree) is not
+// walked again.
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+// -t: which kinds of entry are printed
+enum { FILTER_FILE = 1, FILTER_DIR = 2, FILTER_LINK = 4 };
+
+// What a stat or statx said about an entry
+typedef struct {
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    uid_t uid;
+} meta_t;
+
+typedef struct {
+    int types;                      // FILTER_* bits; 0 means files only
+    int has_meta;                   // some filter needs a stat
+
+    off_t size_min, size_max;       // inclusive
+    time_t mtime_min, mtime_max;    // inclusive
+    int has_uid;
+    uid_t uid;
+
+    char **prune;                   // directory names (globs) not descended into
+    int nprune, cap;
+    int xdev;                       // stay on the start directory's filesystem
+} filter_t;
+
+void filter_init(filter_t *f);
+int filter_add_type(filter_t *f, const char *types);
+int filter_add_size(filter_t *f, const char *text);
+int filter_add_mtime(filter_t *f, const char *text);
+int filter_set_owner(filter_t *f, const char *owner);
+int filter_add_prune(filter_t *f, const char *name);
+int filter_active(const filter_t *f);
+int filter_match(const filter_t *f, const meta_t *m);
+int filter_pruned(const filter_t *f, const char *name);
+void filter_free(filter_t *f);
+
+#endif
@@ -1,200 +1,1475 @@
 // Enable POSIX extensions
 #define _XOPEN_SOURCE 700
+// d_type and the DT_* constants
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
-#include <semaphore.h>   
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <linux/stat.h>
 
-//  GLOBAL OBJECTS 
+#include "arena.h"
+#include "daemon.h"
+#include "filter.h"
+#include "grep.h"
+#include "index.h"
+#include "match.h"
+#include "uring.h"
 
-// MAX number of threads allowed to run at the same time
-#define MAX_THREADS 32
+//  GLOBAL OBJECTS
 
-// Semaphore to limit concurrency
-sem_t thread_sem;
+// Upper bound on workers, whatever the core count says
+#define MAX_THREADS 64
 
-// Mutex only for synchronized printing
+// Stats each worker keeps in flight with -u
+#define URING_DEPTH 256
+
+// Submit queued stats once this many have piled up
+#define URING_BATCH 32
+
+// -s: files up to this size are read into the worker's buffer, larger
+// ones are mapped
+#define READ_MAX (256 * 1024)
+
+// Results are collected per worker and written in chunks of this size
+#define OUT_BUF (64 * 1024)
+
+// Mutex only for synchronized printing: taken once per full buffer
 pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
-// Structure passed to each thread
+// A directory found during the walk.
+// Directories are opened relative to their parent's descriptor, so no
+// path is ever resolved from the root; the parent keeps its directory
+// open until every child has been opened.  The full path is put
+// together from the parent chain only when something has to be printed.
+// Nodes are carved from the queueing worker's arena (arena.h).
+typedef struct dir_node {
+    struct dir_node *parent;
+    atomic_int refs;     // this directory's own visit + children still alive
+    atomic_int users;    // its scan + children not opened yet
+    DIR *dir;
+    uint32_t id;         // -B: position in the walk
+    uint32_t old;        // -B: same directory in the previous index, or INDEX_NONE
+    dev_t dev;           // -x, -L: set by its own search, before any child is queued
+    ino_t ino;
+    char name[];
+} dir_node_t;
+
+// One directory waiting to be searched, or with -s one file in it whose
+// contents are.  A file holds a reference on its directory, which also
+// keeps it open for the relative open.
+typedef struct {
+    dir_node_t *node;
+    char *file;
+} work_t;
+
+// Per-worker double-ended queue of directories.
+// The owner pushes and pops at the bottom, so it walks depth first and its
+// queue stays short; idle workers steal from the top, where the oldest and
+// usually largest subtrees are.
+typedef struct {
+    pthread_mutex_t lock;
+    work_t *items;
+    size_t head, tail;   // top and bottom, counting up; index is & (cap - 1)
+    size_t cap;          // power of two
+} deque_t;
+
+// An entry whose type is still unknown, waiting for its statx.
+// Holds a reference on the directory, which also keeps it open for the
+// relative lookup.
+typedef struct {
+    dir_node_t *node;
+    int follow;          // second round: does this link end at a file?
+    struct statx stx;
+    char name[NAME_MAX + 1];
+} stat_req_t;
+
+// -v: what one worker did.  Only calls the finder makes itself are
+// counted; the getdents behind readdir and the closes are not.
+typedef struct {
+    long dirs;           // directories read
+    long entries;        // names returned by readdir
+    long opens;          // openat of directories and -s files
+    long stats;          // fstat/fstatat
+    long statx;          // statx handed to io_uring (no syscall of their own)
+    long reads;          // read/mmap of -s files
+} walk_stats_t;
+
 typedef struct {
-    char *path;    // directory path this thread will search
-    char *target;  // filename we want to find
-} thread_arg_t;
+    int id;
+    pthread_t tid;
+    deque_t queue;
+    unsigned int seed;   // for picking steal victims
+
+    // -u backend; ring.fd is -1 when the worker stats synchronously
+    uring_t ring;
+    stat_req_t *reqs;
+    int *free_reqs;
+    int nfree;
+    int inflight;
+
+    char *buf;           // -s: READ_MAX bytes for small files
+
+    char *out;           // results not written yet, OUT_BUF bytes
+    size_t out_len;
+
+    walk_stats_t stats;
+
+    arena_t arena;       // nodes and -s names this worker queues
+    char *path;          // build_path's result, reused
+    size_t path_cap;
+} worker_t;
+
+worker_t *workers;
+int num_workers;
+matcher_t matcher;
+int use_uring;
+
+// -s: strings looked for inside files, and the largest file searched
+searcher_t searcher;
+off_t max_size;
+
+// -0: bare paths ending in NUL; -m/-1: stop after this many results
+int null_output;
+long max_results;
+atomic_long results;
+atomic_int stop_walk;    // enough results: drop whatever work is left
+
+// -v: print the walk's counters to stderr when it is over
+int verbose;
+
+// -t/-z/-T/-o: which entries are printed; -P/-x: where the walk goes.
+// -L follows links to directories, each directory walked once.
+filter_t filter;
+int follow_links;
+dev_t root_dev;          // -x: set by the root's search, before any push
+
+// -B, -D: what the walk saw, and the index it replaces (if any)
+index_builder_t *builder;
+index_t *old_index;
+int watch_fd = -1;                      // -D: inotify instance the walk adds its watches to
+atomic_uint next_dir;
+atomic_long reused;
+
+// Where every worker's arena gets its slabs
+arena_pool_t node_pool = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+// Work queued or in progress (directories, and files with -s); the walk is
+// over when it reaches 0
+atomic_long pending;
+
+// Work items sitting in some deque, so sleepers know when to look again
+atomic_long queued;
+
+// Idle workers sleep here instead of spinning on empty deques
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+atomic_int sleepers;
+int done;
 
 
 // Prototypes
-void *thread_func(void *arg);
-void search_dir(const char *path, const char *target);
+void *worker_func(void *arg);
+void search_dir(worker_t *w, dir_node_t *node);
+void handle_entry(worker_t *w, dir_node_t *node, const char *name, unsigned char type, const meta_t *meta);
+void replay_dir(worker_t *w, dir_node_t *node);
+void grep_file(worker_t *w, dir_node_t *node, char *name);
+void drop_work(work_t item);
+int take_result(void);
+int out_printf(worker_t *w, const char *fmt, ...);
+void out_flush(worker_t *w);
+void print_stats(void);
+int build_index(const char *file, const char *start);
+int query_index(const char *file, const char *under);
+int query_daemon(const char *sock, const char *under);
+int setup_uring(worker_t *w);
+int queue_stat(worker_t *w, dir_node_t *node, const char *name, int follow);
+void reap_stats(worker_t *w, int wait);
+int open_dir(dir_node_t *node);
+void release_dir(dir_node_t *node);
+void put_node(dir_node_t *node);
+const char *build_path(worker_t *w, const dir_node_t *node, const char *name);
+int submit(worker_t *w, dir_node_t *parent, const char *name);
+int submit_file(worker_t *w, dir_node_t *node, const char *name);
+int push_work(worker_t *w, work_t item);
+int find_work(worker_t *w, work_t *item);
+void finish_work(void);
+int deque_push(deque_t *q, work_t item);
+int deque_pop(deque_t *q, work_t *item);
+int deque_steal(deque_t *q, work_t *item);
+
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j threads] [-u] [-v] [-i] [-g glob]... [-r regex]... [-f file]\n"
+                    "       [-t fdl] [-z [+-]size]... [-T [+-]age]... [-o owner]\n"
+                    "       [-P name]... [-x] [-L]\n"
+                    "       [-s string]... [-M size] [-0] [-1 | -m max] [-I index | -S socket]\n"
+                    "       <start_directory> [target_filename]...\n"
+                    "       %s [-j threads] [-u] -B index <start_directory>\n"
+                    "       %s [-j threads] [-u] -D socket <start_directory>\n", prog, prog, prog);
+}
 
+// Exact names from a file, one per line
+static int read_names(const char *file) {
+
+    FILE *f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (!f) {
+        perror(file);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int ok = 0;
+    while (ok == 0 && (n = getline(&line, &cap, f)) != -1) {
+        if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+        if (n > 0) ok = matcher_add(&matcher, line, MATCH_EXACT);
+    }
+
+    free(line);
+    if (f != stdin) fclose(f);
+    return ok;
+}
 
+// "512", "64k", "10M", "2G"
+static off_t parse_size(const char *text) {
+
+    char *end;
+    long long n = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return (end == text || *end != '\0' || n <= 0) ? -1 : (off_t)n;
+}
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <start_directory> <target_filename>\n", argv[0]);
+    // one worker per core unless told otherwise
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = cores > 0 ? (int)cores : 1;
+
+    filter_init(&filter);
+
+    int icase = 0;
+    const char *build_file = NULL, *query_file = NULL;
+    const char *daemon_sock = NULL, *query_sock = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:uvg:r:f:iB:I:D:S:s:M:01m:t:z:T:o:P:xL")) != -1) {
+        switch (opt) {
+        case 'j':
+            num_workers = atoi(optarg);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'g':
+            if (matcher_add(&matcher, optarg, MATCH_GLOB) != 0) return 1;
+            break;
+        case 'r':
+            if (matcher_add(&matcher, optarg, MATCH_REGEX) != 0) return 1;
+            break;
+        case 'f':
+            if (read_names(optarg) != 0) return 1;
+            break;
+        case 'i':
+            icase = 1;
+            break;
+        case 'B':
+            build_file = optarg;
+            break;
+        case 'I':
+            query_file = optarg;
+            break;
+        case 'D':
+            daemon_sock = optarg;
+            break;
+        case 'S':
+            query_sock = optarg;
+            break;
+        case 's':
+            if (searcher_add(&searcher, optarg) != 0) return 1;
+            break;
+        case 'M':
+            max_size = parse_size(optarg);
+            if (max_size < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case '0':
+            null_output = 1;
+            break;
+        case '1':
+            max_results = 1;
+            break;
+        case 'm':
+            max_results = atol(optarg);
+            if (max_results < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            if (filter_add_type(&filter, optarg) != 0) return 1;
+            break;
+        case 'z':
+            if (filter_add_size(&filter, optarg) != 0) return 1;
+            break;
+        case 'T':
+            if (filter_add_mtime(&filter, optarg) != 0) return 1;
+            break;
+        case 'o':
+            if (filter_set_owner(&filter, optarg) != 0) return 1;
+            break;
+        case 'P':
+            if (filter_add_prune(&filter, optarg) != 0) return 1;
+            break;
+        case 'x':
+            filter.xdev = 1;
+            break;
+        case 'L':
+            follow_links = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 1) {
+        usage(argv[0]);
         return 1;
     }
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > MAX_THREADS) num_workers = MAX_THREADS;
 
-    char *start = argv[1];
-    char *target = argv[2];
+    char *start = argv[optind];
+    for (int i = optind + 1; i < argc; i++) {
+        if (matcher_add(&matcher, argv[i], MATCH_EXACT) != 0) return 1;
+    }
 
-    // initialize semaphore
-    // MAX_THREADS threads can run concurrently
-    sem_init(&thread_sem, 0, MAX_THREADS);
+    // building takes no patterns; everything else needs at least one.
+    // Content search works on the walk only, and without name patterns
+    // looks into every file.  So do filters and pruning: the index and
+    // the daemon keep names only, and always the whole tree.
+    int building = build_file || daemon_sock;
+    int patterns = matcher.npatterns + searcher.n;
+    int walk_only = searcher.n || filter_active(&filter) || follow_links;
+    if (building != (patterns == 0) || (build_file && daemon_sock) ||
+        (query_file && query_sock) || (building && (query_file || query_sock)) ||
+        (walk_only && (building || query_file || query_sock))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // one walk answers every pattern at once
+    if (matcher.npatterns && matcher_compile(&matcher, icase, num_workers) != 0) {
+        return 1;
+    }
+    searcher_compile(&searcher, icase);
+
+
+    if (query_file || query_sock) {
+        int rc = query_file ? query_index(query_file, start) : query_daemon(query_sock, start);
+        matcher_free(&matcher);
+        return rc;
+    }
 
-    //prepare root argument 
-    thread_arg_t *root_arg = malloc(sizeof(thread_arg_t));
-    if (!root_arg) {
+    // every directory with unopened children holds a descriptor, roughly
+    // tree depth per worker; allow as many as the hard limit permits
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    workers = calloc(num_workers, sizeof(worker_t));
+    if (!workers) {
         fprintf(stderr, "Out of memory\n");
         return 1;
     }
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].seed = i + 1;
+        workers[i].ring.fd = -1;
+        workers[i].arena.pool = &node_pool;
+        pthread_mutex_init(&workers[i].queue.lock, NULL);
+    }
 
-    root_arg->path = strdup(start);
-    if (!root_arg->path) {
+    // without io_uring every worker simply stats synchronously
+    if (use_uring) {
+        for (int i = 0; i < num_workers; i++) {
+            if (setup_uring(&workers[i]) != 0) {
+                fprintf(stderr, "io_uring unavailable, using fstatat\n");
+                break;
+            }
+        }
+    }
+
+    index_builder_t build;
+    index_t old;
+    if (building) {
+        if (builder_init(&build, num_workers) != 0) return 1;
+        builder = &build;
+    }
+    if (daemon_sock) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd == -1) {
+            perror("inotify_init1");
+            return 1;
+        }
+    }
+    if (build_file) {
+        // an index of the same tree is refreshed, anything else rebuilt
+        char *root = realpath(start, NULL);
+        if (root && index_open(&old, build_file) == 0) {
+            if (strcmp(old.root, root) == 0 && index_prepare_refresh(&old) == 0) {
+                old_index = &old;
+            } else {
+                index_close(&old);
+            }
+        }
+        free(root);
+    }
+
+    // the root directory is the first piece of work; everything else is
+    // discovered by the workers themselves
+    if (submit(&workers[0], NULL, start) != 0) {
         fprintf(stderr, "Out of memory\n");
-        free(root_arg);
         return 1;
     }
-    root_arg->target = target;
 
-    //start searching in the root directory
-    search_dir(root_arg->path, root_arg->target);
+    int started = 0;
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_func, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed for worker %d\n", i);
+            break;
+        }
+        started++;
+    }
 
-    // cleanup
-    free(root_arg->path);
-    free(root_arg);
+    // deques of workers that never started are still drained by stealing
+    if (started == 0) {
+        worker_func(&workers[0]);
+    }
 
-    // destroy semaphore
-    sem_destroy(&thread_sem);
+    // flat join: no worker ever waits for another one
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
 
-    return 0;
+    if (verbose) print_stats();
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_destroy(&workers[i].queue.lock);
+        free(workers[i].queue.items);
+        if (workers[i].ring.fd != -1) uring_exit(&workers[i].ring);
+        free(workers[i].reqs);
+        free(workers[i].free_reqs);
+        free(workers[i].buf);
+        free(workers[i].out);
+        free(workers[i].path);
+    }
+    free(workers);
+    arena_pool_destroy(&node_pool);
+    matcher_free(&matcher);
+    searcher_free(&searcher);
+    filter_free(&filter);
+
+    int rc = 0;
+    if (build_file) {
+        rc = build_index(build_file, start);
+        if (old_index) index_close(old_index);
+        builder_free(builder);
+    }
+    if (daemon_sock) {
+        // from here on the daemon owns what the walk recorded
+        char *root = realpath(start, NULL);
+        if (!root) {
+            perror(start);
+            return 1;
+        }
+        rc = daemon_run(daemon_sock, root, builder, watch_fd);
+        free(root);
+    }
+
+    return rc;
 }
 
 
 
-//THREAD ENTRY FUNCTION
-void *thread_func(void *arg) {
+//WORKER LOOP
+void *worker_func(void *arg) {
+
+    worker_t *w = (worker_t*) arg;
+    work_t item;
 
-    thread_arg_t *targ = (thread_arg_t*) arg;
+    while (1) {
+
+        if (find_work(w, &item)) {
+            if (atomic_load_explicit(&stop_walk, memory_order_relaxed)) {
+                drop_work(item);
+            } else if (item.file) {
+                grep_file(w, item.node, item.file);
+            } else {
+                search_dir(w, item.node);
+            }
+            finish_work();
+            if (w->inflight) reap_stats(w, 0);
+            continue;
+        }
 
-    search_dir(targ->path, targ->target);
+        // stats still in flight may turn up more directories
+        if (w->inflight) {
+            reap_stats(w, 1);
+            continue;
+        }
 
-    // free memory for this thread's argument
-    free(targ->path);
-    free(targ);
+        // nothing to pop or steal: sleep until someone queues a directory
+        // or the walk is over
+        pthread_mutex_lock(&idle_lock);
+        if (done) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
 
-    // IMPORTANT: signal semaphore → a thread slot is now free
-    sem_post(&thread_sem);
+        // a push either sees this sleeper and signals, or happened before
+        // and is visible in queued
+        atomic_fetch_add(&sleepers, 1);
+        if (atomic_load(&queued) <= 0) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        atomic_fetch_sub(&sleepers, 1);
+        pthread_mutex_unlock(&idle_lock);
+    }
 
+    out_flush(w);
+    arena_retire(&w->arena);
     return NULL;
 }
 
 
 
+// d_type for a stat result.  Without -L a followed link only counts when
+// it ends at a regular file, so links are never descended into; with -L
+// the ancestor check in search_dir keeps a link upwards from looping.
+static unsigned char mode_type(mode_t mode, int followed) {
+    if (S_ISREG(mode)) return DT_REG;
+    if (followed && !follow_links) return DT_UNKNOWN;
+    if (S_ISDIR(mode)) return DT_DIR;
+    if (S_ISLNK(mode)) return DT_LNK;
+    return DT_UNKNOWN;
+}
+
+// While building an index every name is of interest, and so is every
+// file when only contents are searched
+static int name_matches(worker_t *w, const char *name) {
+    if (builder || matcher.npatterns == 0)
+        return 1;
+    return matcher_match(&matcher, w->id, name, strlen(name));
+}
+
+// -t: the kinds of entry printed, regular files unless asked otherwise
+static int type_wanted(unsigned char type) {
+    int types = filter.types ? filter.types : FILTER_FILE;
+    switch (type) {
+    case DT_REG: return types & FILTER_FILE;
+    case DT_DIR: return types & FILTER_DIR;
+    case DT_LNK: return types & FILTER_LINK;
+    }
+    return 0;
+}
+
+// A link is followed to see where it ends: always with -L, otherwise
+// when its name matches, unless -t l asks for links themselves
+static int follow_link(worker_t *w, const char *name) {
+    if (follow_links)
+        return 1;
+    return !(filter.types & FILTER_LINK) && name_matches(w, name);
+}
+
+// Only a possible result is stat'ed for -z/-T/-o, and only then
+static int needs_meta(worker_t *w, unsigned char type, const char *name) {
+    return filter.has_meta && type_wanted(type) && name_matches(w, name);
+}
+
+static void meta_from_stat(meta_t *m, const struct stat *st) {
+    m->mode = st->st_mode;
+    m->size = st->st_size;
+    m->mtime = st->st_mtime;
+    m->uid = st->st_uid;
+}
+
+static void meta_from_statx(meta_t *m, const struct statx *stx) {
+    m->mode = stx->stx_mode;
+    m->size = (off_t)stx->stx_size;
+    m->mtime = (time_t)stx->stx_mtime.tv_sec;
+    m->uid = stx->stx_uid;
+}
 
 //DIRECTORY SEARCH
-void search_dir(const char *path, const char *target) {
+void search_dir(worker_t *w, dir_node_t *node) {
 
-    DIR *dir = opendir(path);
-    if (!dir) {
-        fprintf(stderr, "Error: cannot open directory: %s\n", path);
+    w->stats.opens++;
+    if (open_dir(node) != 0) {
+        const char *path = build_path(w, node, NULL);
+        fprintf(stderr, "Error: cannot open directory: %s\n", path ? path : node->name);
+        put_node(node);
         return;
     }
 
+    int dfd = dirfd(node->dir);
     struct dirent *entry;
 
-    // dynamic array for child thread IDs
-    pthread_t *child_threads = NULL;
-    size_t child_count = 0;
-    size_t child_cap = 0;
+    // -x, -L: the directory's own identity.  Another filesystem is not
+    // entered, and with -L a directory that is also one of its ancestors
+    // (reached through a link back up) is a loop and not walked again.
+    // Only the path's own ancestors count: the same directory reached
+    // through two different links is walked under both, as find -L does.
+    if (filter.xdev || follow_links) {
+        struct stat st;
+        int skip = 0;
+        w->stats.stats++;
+        if (fstat(dfd, &st) != 0) {
+            skip = 1;
+        } else {
+            node->dev = st.st_dev;
+            node->ino = st.st_ino;
+            if (!node->parent) root_dev = st.st_dev;
+            if (filter.xdev && st.st_dev != root_dev) {
+                skip = 1;
+            } else if (follow_links) {
+                for (const dir_node_t *a = node->parent; a && !skip; a = a->parent) {
+                    skip = a->dev == st.st_dev && a->ino == st.st_ino;
+                }
+            }
+        }
+        if (skip) {
+            release_dir(node);
+            put_node(node);
+            return;
+        }
+    }
+    w->stats.dirs++;
+
+    //  INDEX
+    // an unchanged directory is not read again; its entries come from the
+    // previous index.  The daemon watches before reading, so nothing
+    // created in between goes unseen.
+    if (builder) {
+        struct stat st;
+        int wd = watch_fd != -1 ? watch_dir(watch_fd, dfd) : -1;
+        w->stats.stats++;
+        if (fstat(dfd, &st) != 0 ||
+            builder_dir(builder, w->id, node->id, node->parent ? node->parent->id : INDEX_NONE,
+                        node->parent ? node->name : "", &st, wd) != 0) {
+            fprintf(stderr, "Out of memory\n");
+        } else if (old_index && index_dir_unchanged(old_index, node->old, &st)) {
+            replay_dir(w, node);
+            release_dir(node);
+            put_node(node);
+            return;
+        }
+    }
 
     // iterate through directory entries
-    while ((entry = readdir(dir)) != NULL) {
+    while ((entry = readdir(node->dir)) != NULL &&
+           !atomic_load_explicit(&stop_walk, memory_order_relaxed)) {
 
-        if (strcmp(entry->d_name, ".") == 0 ||
-            strcmp(entry->d_name, "..") == 0)
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
             continue;
+        w->stats.entries++;
 
-        char newpath[1024];
-        snprintf(newpath, sizeof(newpath), "%s/%s", path, entry->d_name);
+        // trust d_type; only filesystems that leave it unknown cost a
+        // stat, a link only when it has to be followed, and anything else
+        // only when it is a result unless -z/-T/-o say otherwise
+        unsigned char type = entry->d_type;
+        int follow = type == DT_LNK && follow_link(w, name);
+        meta_t meta, *mp = NULL;
+        if (type == DT_UNKNOWN || follow || needs_meta(w, type, name)) {
+            if (w->ring.fd != -1 && queue_stat(w, node, name, follow) == 0)
+                continue;
 
-        struct stat st;
-        if (stat(newpath, &st) != 0)
-            continue;
+            struct stat st;
+            w->stats.stats++;
+            if (fstatat(dfd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = mode_type(st.st_mode, follow);
+            if (type == DT_LNK && follow_link(w, name)) {
+                w->stats.stats++;
+                if (fstatat(dfd, name, &st, 0) != 0)
+                    continue;
+                type = mode_type(st.st_mode, 1);
+            }
+            meta_from_stat(&meta, &st);
+            mp = &meta;
+        }
 
-        //  FILE 
-        if (S_ISREG(st.st_mode)) {
-            if (strcmp(entry->d_name, target) == 0) {
+        handle_entry(w, node, name, type, mp);
+    }
 
-                pthread_mutex_lock(&print_lock);
-                printf("Found by thread %lu: %s\n",
-                    (unsigned long)pthread_self(),
-                    newpath);
-                pthread_mutex_unlock(&print_lock);
+    // whatever this directory queued goes to the kernel in one call
+    if (w->ring.fd != -1) uring_submit(&w->ring, 0);
+
+    release_dir(node);
+    put_node(node);
+}
+
+
+
+void handle_entry(worker_t *w, dir_node_t *node, const char *name, unsigned char type, const meta_t *meta) {
+
+    // a result is of a kind -t asks for, matches by name and passes the
+    // size, time and owner filters on the stat made for them
+    int hit = type_wanted(type) && name_matches(w, name) &&
+              (!filter.has_meta || (meta && filter_match(&filter, meta)));
+
+    //  FILE
+    if (type == DT_REG && builder) {
+        if (builder_file(builder, w->id, node->id, name) != 0) {
+            fprintf(stderr, "Out of memory\n");
+        }
+    } else if (type == DT_REG && searcher.n && hit) {
+        // the contents are searched as a work item of their own, so a
+        // directory full of large files spreads over all workers
+        if (submit_file(w, node, name) != 0) {
+            fprintf(stderr, "Out of memory, skipping %s\n", name);
+        }
+    } else if (hit && !builder && !searcher.n) {
 
+        const char *path = build_path(w, node, name);
+        if (!path) {
+            fprintf(stderr, "Out of memory\n");
+            return;
+        }
+
+        if (take_result()) {
+            if (null_output) {
+                out_printf(w, "%s%c", path, '\0');
+            } else {
+                out_printf(w, "Found by thread %lu: %s\n",
+                    (unsigned long)pthread_self(),
+                    path);
             }
         }
+    }
+
+    //  DIRECTORY
+    // queued on this worker's own deque; no thread is created and
+    // nobody waits for the subtree to finish.  A pruned one is never
+    // opened at all.
+    if (type == DT_DIR && !filter_pruned(&filter, name)) {
+        if (submit(w, node, name) != 0) {
+            fprintf(stderr, "Out of memory, skipping %s\n", name);
+        }
+    }
+}
 
-        //  DIRECTORY 
-        if (S_ISDIR(st.st_mode)) {
 
-            // Wait for permission to create a new thread
-            // If too many threads exist → waits here.
-            sem_wait(&thread_sem);
 
-            // prepare argument struct
-            thread_arg_t *child_arg = malloc(sizeof(thread_arg_t));
-            if (!child_arg) {
-                sem_post(&thread_sem);
-                continue;
+void replay_dir(worker_t *w, dir_node_t *node) {
+
+    const index_t *ix = old_index;
+    uint32_t d = node->old;
+    char name[256];
+
+    for (uint32_t i = ix->file_start[d]; i < ix->file_start[d + 1]; i++) {
+        index_name(ix, ix->file_names[i], name);
+        if (builder_file(builder, w->id, node->id, name) != 0) {
+            fprintf(stderr, "Out of memory\n");
+        }
+    }
+
+    // subdirectories still have to be checked one by one: a change deep
+    // down does not touch this directory's mtime
+    for (uint32_t i = ix->sub_start[d]; i < ix->sub_start[d + 1]; i++) {
+        const char *sub = ix->dir_names[ix->sub_dirs[i]];
+        if (submit(w, node, sub) != 0) {
+            fprintf(stderr, "Out of memory, skipping %s\n", sub);
+        }
+    }
+
+    atomic_fetch_add(&reused, 1);
+}
+
+
+
+//OUTPUT
+// Count one more result; 0 when the limit was already reached.  The one
+// that reaches it tells every worker to stop.
+int take_result(void) {
+
+    if (max_results == 0)
+        return 1;
+
+    long n = atomic_fetch_add(&results, 1) + 1;
+    if (n >= max_results) atomic_store(&stop_walk, 1);
+    return n <= max_results;
+}
+
+
+
+// Format into the worker's buffer; only a full buffer takes print_lock
+int out_printf(worker_t *w, const char *fmt, ...) {
+
+    if (!w->out) {
+        w->out = malloc(OUT_BUF);
+        if (!w->out) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(w->out + w->out_len, OUT_BUF - w->out_len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+
+    if ((size_t)n >= OUT_BUF - w->out_len) {
+        out_flush(w);
+        if ((size_t)n < OUT_BUF) {
+            va_start(ap, fmt);
+            vsnprintf(w->out, OUT_BUF, fmt, ap);
+            va_end(ap);
+        } else {
+            // longer than a whole buffer: straight out, still in one piece
+            char *big = malloc(n + 1);
+            if (!big) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
             }
+            va_start(ap, fmt);
+            vsnprintf(big, n + 1, fmt, ap);
+            va_end(ap);
+            pthread_mutex_lock(&print_lock);
+            fwrite(big, 1, n, stdout);
+            pthread_mutex_unlock(&print_lock);
+            free(big);
+            return 0;
+        }
+    }
+    w->out_len += n;
+    return 0;
+}
 
-            child_arg->path = strdup(newpath);
-            if (!child_arg->path) {
-                free(child_arg);
-                sem_post(&thread_sem);
-                continue;
+
+
+void out_flush(worker_t *w) {
+
+    if (w->out_len == 0)
+        return;
+
+    pthread_mutex_lock(&print_lock);
+    fwrite(w->out, 1, w->out_len, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&print_lock);
+    w->out_len = 0;
+}
+
+
+
+// After -1/-m is satisfied queued work is only released, never done
+void drop_work(work_t item) {
+
+    if (item.file) {
+        release_dir(item.node);
+        arena_free(&node_pool, item.file);
+    } else if (item.node->parent) {
+        release_dir(item.node->parent);
+    }
+    put_node(item.node);
+}
+
+
+
+//CONTENT SEARCH
+typedef struct {
+    worker_t *w;
+    dir_node_t *node;
+    const char *name;
+    const char *path;    // built at the first matching line
+} grep_ctx_t;
+
+static int print_line(void *arg, const char *line, size_t len, size_t line_no) {
+
+    grep_ctx_t *ctx = arg;
+    if (!ctx->path) {
+        ctx->path = build_path(ctx->w, ctx->node, ctx->name);
+        if (!ctx->path) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    if (!take_result())
+        return 1;
+
+    // -0 lists each file once, as grep -lZ does
+    if (null_output) {
+        out_printf(ctx->w, "%s%c", ctx->path, '\0');
+        return 1;
+    }
+    out_printf(ctx->w, "%s:%zu:%.*s\n", ctx->path, line_no, (int)len, line);
+    return atomic_load_explicit(&stop_walk, memory_order_relaxed);
+}
+
+// Search one file for the -s strings.  Small files are read into the
+// worker's buffer in one call; larger ones are mapped, which saves the
+// copy.  Binary files and files over -M are skipped.
+void grep_file(worker_t *w, dir_node_t *node, char *name) {
+
+    int fd = openat(dirfd(node->dir), name, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    release_dir(node);
+    w->stats.opens++;
+    if (fd != -1) w->stats.stats++;
+
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (max_size == 0 || st.st_size <= max_size)) {
+
+        grep_ctx_t ctx = { w, node, name, NULL };
+        const char *data = NULL;
+        size_t len = 0;
+        void *map = MAP_FAILED;
+
+        if (st.st_size <= READ_MAX) {
+            if (!w->buf) w->buf = malloc(READ_MAX);
+            ssize_t n = 0, got;
+            while (w->buf && n < st.st_size &&
+                   (got = read(fd, w->buf + n, READ_MAX - n)) > 0) {
+                n += got;
+                w->stats.reads++;
+            }
+            data = w->buf;
+            len = n > 0 ? (size_t)n : 0;
+        } else {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            w->stats.reads++;
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                data = map;
+                len = st.st_size;
             }
-            child_arg->target = (char *)target;
+        }
+
+        if (data && len > 0 && !searcher_binary(data, len)) {
+            searcher_scan(&searcher, data, len, print_line, &ctx);
+        }
+
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+    }
+
+    if (fd != -1) close(fd);
+    arena_free(&node_pool, name);
+    put_node(node);
+}
+
+
+
+// One line on stderr, the same for every mode, so scripts (and bench)
+// can pick it up
+void print_stats(void) {
+
+    walk_stats_t sum = { 0 };
+    unsigned long enters = 0;
+    for (int i = 0; i < num_workers; i++) {
+        sum.dirs += workers[i].stats.dirs;
+        sum.entries += workers[i].stats.entries;
+        sum.opens += workers[i].stats.opens;
+        sum.stats += workers[i].stats.stats;
+        sum.statx += workers[i].stats.statx;
+        sum.reads += workers[i].stats.reads;
+        enters += workers[i].ring.enters;
+    }
+
+    fprintf(stderr, "Walk: %ld directories, %ld entries, %ld opens, %ld stats, "
+                    "%ld statx, %lu io_uring_enter, %ld reads, %d workers\n",
+            sum.dirs, sum.entries, sum.opens, sum.stats,
+            sum.statx, enters, sum.reads, num_workers);
+}
+
+
+
+//INDEX FILES
+int build_index(const char *file, const char *start) {
+
+    char *root = realpath(start, NULL);
+    if (!root) {
+        perror(start);
+        return 1;
+    }
+
+    int rc = builder_write(builder, file, root) == 0 ? 0 : 1;
+    if (rc == 0) {
+        unsigned int dirs = atomic_load(&next_dir);
+        long kept = atomic_load(&reused);
+        fprintf(stderr, "Indexed %s: %u directories, %ld read again\n", root, dirs, (long)dirs - kept);
+    }
+    free(root);
+    return rc;
+}
+
+
+
+static void print_found(void *arg, const char *path) {
+    (void)arg;
+    if (!take_result())
+        return;
+    if (null_output) {
+        printf("%s%c", path, '\0');
+    } else {
+        printf("Found in index: %s\n", path);
+    }
+}
+
+int query_index(const char *file, const char *under) {
+
+    index_t ix;
+    if (index_open(&ix, file) != 0) {
+        perror(file);
+        return 1;
+    }
+
+    // results are absolute paths; keep those below the start directory
+    char *root = realpath(under, NULL);
+    if (!root) {
+        perror(under);
+        index_close(&ix);
+        return 1;
+    }
+
+    index_query(&ix, &matcher, root, print_found, NULL);
+
+    free(root);
+    index_close(&ix);
+    return 0;
+}
+
+int query_daemon(const char *sock, const char *under) {
+
+    char *root = realpath(under, NULL);
+    if (!root) {
+        perror(under);
+        return 1;
+    }
+
+    int rc = daemon_query(sock, &matcher, root, print_found, NULL);
+
+    free(root);
+    return rc;
+}
+
+
+
+// Open a queued directory relative to its parent, then let go of the
+// parent's descriptor.
+int open_dir(dir_node_t *node) {
+
+    int fd;
+    if (node->parent) {
+        fd = openat(dirfd(node->parent->dir), node->name,
+                    O_RDONLY | O_DIRECTORY | (follow_links ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+        release_dir(node->parent);
+    } else {
+        fd = open(node->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd == -1)
+        return -1;
+
+    node->dir = fdopendir(fd);
+    if (!node->dir) {
+        close(fd);
+        return -1;
+    }
+    atomic_store(&node->users, 1);
+    return 0;
+}
+
+
+
+void release_dir(dir_node_t *node) {
+
+    if (atomic_fetch_sub(&node->users, 1) == 1) {
+        closedir(node->dir);
+        node->dir = NULL;
+    }
+}
+
+
+
+// Drop a reference; a directory goes away with its last descendant, and
+// may take its parents along.  Its slab is released with the last node in
+// it.
+void put_node(dir_node_t *node) {
+
+    while (node && atomic_fetch_sub(&node->refs, 1) == 1) {
+        dir_node_t *parent = node->parent;
+        arena_free(&node_pool, node);
+        node = parent;
+    }
+}
+
+
+
+// "<root>/<dir>/.../<name>", or the directory itself when name is NULL.
+// Put together in the worker's buffer, so it is good until the worker's
+// next call.
+const char *build_path(worker_t *w, const dir_node_t *node, const char *name) {
+
+    size_t len = name ? strlen(name) : 0;
+    for (const dir_node_t *n = node; n; n = n->parent) {
+        len += strlen(n->name) + 1;
+    }
+
+    if (len + 1 > w->path_cap) {
+        size_t new_cap = w->path_cap ? w->path_cap * 2 : 1024;
+        while (new_cap < len + 1) new_cap *= 2;
+        char *tmp = realloc(w->path, new_cap);
+        if (!tmp)
+            return NULL;
+        w->path = tmp;
+        w->path_cap = new_cap;
+    }
+
+    char *path = w->path;
+
+    char *p = path + len;
+    *p = '\0';
+    if (name) {
+        size_t l = strlen(name);
+        p -= l;
+        memcpy(p, name, l);
+    }
+    for (const dir_node_t *n = node; n; n = n->parent) {
+        size_t l = strlen(n->name);
+        // a root given as "dir/" already ends in the separator
+        if (p != path + len && (n->parent || l == 0 || n->name[l - 1] != '/'))
+            *--p = '/';
+        p -= l;
+        memcpy(p, n->name, l);
+    }
+    return p;
+}
+
+
+
+//IO_URING STATS
+int setup_uring(worker_t *w) {
+
+    if (uring_init(&w->ring, URING_DEPTH) != 0)
+        return -1;
+    if (!uring_supports(&w->ring, IORING_OP_STATX)) {
+        uring_exit(&w->ring);
+        return -1;
+    }
+
+    w->reqs = malloc(URING_DEPTH * sizeof(stat_req_t));
+    w->free_reqs = malloc(URING_DEPTH * sizeof(int));
+    if (!w->reqs || !w->free_reqs) {
+        uring_exit(&w->ring);
+        return -1;
+    }
+    for (int i = 0; i < URING_DEPTH; i++) {
+        w->free_reqs[i] = i;
+    }
+    w->nfree = URING_DEPTH;
+    return 0;
+}
 
-            pthread_t tid;
-            int rc = pthread_create(&tid, NULL, thread_func, child_arg);
 
-            if (rc != 0) {
-                fprintf(stderr, "pthread_create failed for %s\n", newpath);
-                free(child_arg->path);
-                free(child_arg);
-                sem_post(&thread_sem);
+
+static void prep_stat(struct io_uring_sqe *sqe, stat_req_t *req, int idx) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd(req->node->dir);
+    sqe->addr = (unsigned long)req->name;
+    sqe->len = STATX_TYPE | STATX_MODE |
+               (filter.has_meta ? STATX_SIZE | STATX_MTIME | STATX_UID : 0);
+    sqe->addr2 = (unsigned long)&req->stx;
+    sqe->statx_flags = req->follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = idx;
+}
+
+
+
+// Queue a statx of name relative to node's directory.  The request counts
+// as pending work, so nobody declares the walk over while the answer may
+// still add directories.  -1 means stat it synchronously instead.
+int queue_stat(worker_t *w, dir_node_t *node, const char *name, int follow) {
+
+    size_t len = strlen(name);
+    if (len > NAME_MAX)
+        return -1;
+
+    // all slots busy: wait for some to come back
+    while (w->nfree == 0) {
+        reap_stats(w, 1);
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe)
+        return -1;
+
+    int idx = w->free_reqs[--w->nfree];
+    stat_req_t *req = &w->reqs[idx];
+    req->node = node;
+    req->follow = follow;
+    memcpy(req->name, name, len + 1);
+
+    atomic_fetch_add(&node->refs, 1);
+    atomic_fetch_add(&node->users, 1);
+    atomic_fetch_add(&pending, 1);
+    w->inflight++;
+
+    prep_stat(sqe, req, idx);
+    w->stats.statx++;
+
+    if (w->ring.sq_local - *w->ring.sq_tail >= URING_BATCH) {
+        uring_submit(&w->ring, 0);
+    }
+    return 0;
+}
+
+
+
+// Handle finished stats, first waiting for at least one if asked to
+void reap_stats(worker_t *w, int wait) {
+
+    if (uring_submit(&w->ring, wait) < 0 && wait) {
+        perror("io_uring_enter");
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(&w->ring)) != NULL) {
+
+        int idx = (int)cqe->user_data;
+        int res = cqe->res;
+        uring_seen(&w->ring);
+
+        stat_req_t *req = &w->reqs[idx];
+        dir_node_t *node = req->node;
+        unsigned char type = DT_UNKNOWN;
+        meta_t meta;
+        if (res == 0) {
+            type = mode_type(req->stx.stx_mode, req->follow);
+            meta_from_statx(&meta, &req->stx);
+        }
+
+        // an unknown entry turned out to be a link to follow: one more
+        // round to see where it points, on the same slot
+        if (type == DT_LNK && follow_link(w, req->name)) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+            if (sqe) {
+                req->follow = 1;
+                prep_stat(sqe, req, idx);
+                w->stats.statx++;
                 continue;
             }
+        }
 
-            // expand array if needed
-            if (child_count + 1 > child_cap) {
-                size_t new_cap = (child_cap == 0 ? 8 : child_cap * 2);
-                pthread_t *tmp = realloc(child_threads, new_cap * sizeof(pthread_t));
-                if (tmp) {
-                    child_threads = tmp;
-                    child_cap = new_cap;
-                }
-            }
+        handle_entry(w, node, req->name, type, res == 0 ? &meta : NULL);
 
-            if (child_count < child_cap) {
-                child_threads[child_count++] = tid;
-            }
+        w->free_reqs[w->nfree++] = idx;
+        w->inflight--;
+        release_dir(node);
+        put_node(node);
+        finish_work();
+    }
+}
+
+
+
+//WORK QUEUES
+int submit(worker_t *w, dir_node_t *parent, const char *name) {
+
+    size_t len = strlen(name);
+    dir_node_t *node = arena_alloc(&w->arena, sizeof(dir_node_t) + len + 1);
+    if (!node)
+        return -1;
+
+    node->parent = parent;
+    atomic_init(&node->refs, 1);
+    atomic_init(&node->users, 0);
+    node->dir = NULL;
+    memcpy(node->name, name, len + 1);
+
+    node->id = atomic_fetch_add(&next_dir, 1);
+    node->old = INDEX_NONE;
+    if (old_index) {
+        node->old = parent ? index_child(old_index, parent->old, name) : 0;
+    }
+
+    // the child needs the parent's name for printing and its
+    // descriptor for opening
+    if (parent) {
+        atomic_fetch_add(&parent->refs, 1);
+        atomic_fetch_add(&parent->users, 1);
+    }
+
+    work_t item = { node, NULL };
+    if (push_work(w, item) != 0) {
+        if (parent) release_dir(parent);
+        put_node(node);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+// A file of a directory being searched, for grep_file
+int submit_file(worker_t *w, dir_node_t *node, const char *name) {
+
+    size_t len = strlen(name);
+    char *copy = arena_alloc(&w->arena, len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, name, len + 1);
+
+    atomic_fetch_add(&node->refs, 1);
+    atomic_fetch_add(&node->users, 1);
+
+    work_t item = { node, copy };
+    if (push_work(w, item) != 0) {
+        release_dir(node);
+        put_node(node);
+        arena_free(&node_pool, copy);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int push_work(worker_t *w, work_t item) {
+
+    atomic_fetch_add(&pending, 1);
+    if (deque_push(&w->queue, item) != 0) {
+        atomic_fetch_sub(&pending, 1);
+        return -1;
+    }
+    atomic_fetch_add(&queued, 1);
+
+    if (atomic_load(&sleepers) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return 0;
+}
+
+
+
+// Own deque first, then the others, starting from a random victim so
+// thieves spread out instead of all hitting worker 0.
+int find_work(worker_t *w, work_t *item) {
+
+    if (deque_pop(&w->queue, item)) {
+        atomic_fetch_sub(&queued, 1);
+        return 1;
+    }
+
+    int start = rand_r(&w->seed) % num_workers;
+    for (int i = 0; i < num_workers; i++) {
+        int victim = (start + i) % num_workers;
+        if (victim == w->id)
+            continue;
+        if (deque_steal(&workers[victim].queue, item)) {
+            atomic_fetch_sub(&queued, 1);
+            return 1;
         }
     }
+    return 0;
+}
+
+
 
-    //  JOIN ALL CHILD THREADS 
-    for (size_t i = 0; i < child_count; i++) {
-        pthread_join(child_threads[i], NULL);
+void finish_work(void) {
+
+    // last directory done: wake everybody so they can exit
+    if (atomic_fetch_sub(&pending, 1) == 1) {
+        pthread_mutex_lock(&idle_lock);
+        done = 1;
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+
+
+int deque_push(deque_t *q, work_t item) {
+
+    pthread_mutex_lock(&q->lock);
+
+    // full: double the ring, keeping items in top-to-bottom order
+    if (q->tail - q->head == q->cap) {
+        size_t new_cap = (q->cap == 0 ? 64 : q->cap * 2);
+        work_t *tmp = malloc(new_cap * sizeof(work_t));
+        if (!tmp) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for (size_t i = q->head; i != q->tail; i++) {
+            tmp[i & (new_cap - 1)] = q->items[i & (q->cap - 1)];
+        }
+        free(q->items);
+        q->items = tmp;
+        q->cap = new_cap;
+    }
+
+    q->items[q->tail & (q->cap - 1)] = item;
+    q->tail++;
+
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+
+
+int deque_pop(deque_t *q, work_t *item) {
+
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != q->head) {
+        q->tail--;
+        *item = q->items[q->tail & (q->cap - 1)];
+        found = 1;
     }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
 
-    free(child_threads);
-    closedir(dir);
+
+int deque_steal(deque_t *q, work_t *item) {
+
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != q->head) {
+        *item = q->items[q->head & (q->cap - 1)];
+        q->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
 }
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "grep.h"
+
+// Bytes looked at to tell a binary file from text, as grep does
+#define BINARY_PROBE 4096
+
+static unsigned char fold(unsigned char c, int icase);
+static int same(const unsigned char *text, const unsigned char *needle, size_t n, int icase);
+static size_t find(const searcher_t *s, int k, const unsigned char *buf, size_t from, size_t len);
+
+
+
+int searcher_add(searcher_t *s, const char *text) {
+
+    size_t len = strlen(text);
+    if (len == 0) {
+        fprintf(stderr, "Error: empty search string\n");
+        return -1;
+    }
+
+    if (s->n == s->cap) {
+        int new_cap = (s->cap == 0 ? 8 : s->cap * 2);
+        unsigned char **needles = realloc(s->needles, new_cap * sizeof(unsigned char *));
+        if (!needles) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        s->needles = needles;
+        size_t *lens = realloc(s->lens, new_cap * sizeof(size_t));
+        if (!lens) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        s->lens = lens;
+        s->cap = new_cap;
+    }
+
+    unsigned char *copy = (unsigned char *)strdup(text);
+    if (!copy) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    s->needles[s->n] = copy;
+    s->lens[s->n] = len;
+    s->n++;
+    return 0;
+}
+
+
+
+void searcher_compile(searcher_t *s, int icase) {
+
+    s->icase = icase;
+    for (int k = 0; k < s->n; k++) {
+        for (size_t i = 0; i < s->lens[k]; i++) {
+            s->needles[k][i] = fold(s->needles[k][i], icase);
+        }
+    }
+}
+
+
+
+// A NUL near the start means binary, as in grep
+int searcher_binary(const char *buf, size_t len) {
+    return memchr(buf, '\0', len < BINARY_PROBE ? len : BINARY_PROBE) != NULL;
+}
+
+
+
+// Every line holding one of the strings goes to found, in order, once.
+// found returns nonzero to stop early.
+void searcher_scan(const searcher_t *s, const char *buf, size_t len,
+                   int (*found)(void *arg, const char *line, size_t len, size_t line_no), void *arg) {
+
+    const unsigned char *text = (const unsigned char *)buf;
+
+    // next[k]: where string k occurs next, len if nowhere
+    size_t small[16];
+    size_t *next = s->n <= 16 ? small : malloc(s->n * sizeof(size_t));
+    if (!next) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+    for (int k = 0; k < s->n; k++) {
+        next[k] = find(s, k, text, 0, len);
+    }
+
+    size_t line_no = 1, counted = 0;
+    for (;;) {
+        size_t hit = len;
+        for (int k = 0; k < s->n; k++) {
+            if (next[k] < hit) hit = next[k];
+        }
+        if (hit == len)
+            break;
+
+        // line numbers only advance over what lies between two hits
+        const char *p = buf + counted;
+        while ((p = memchr(p, '\n', hit - (p - buf))) != NULL) {
+            line_no++;
+            p++;
+        }
+
+        const char *nl = memchr(buf + hit, '\n', len - hit);
+        size_t end = nl ? (size_t)(nl - buf) : len;
+        size_t start = hit;
+        while (start > 0 && buf[start - 1] != '\n') start--;
+
+        if (found(arg, buf + start, end - start, line_no))
+            break;
+
+        // one report per line: every string resumes after it
+        counted = end;
+        for (int k = 0; k < s->n; k++) {
+            if (next[k] <= end) next[k] = end < len ? find(s, k, text, end + 1, len) : len;
+        }
+        if (end < len) {
+            line_no++;
+            counted = end + 1;
+        }
+    }
+
+    if (next != small) free(next);
+}
+
+
+
+void searcher_free(searcher_t *s) {
+
+    for (int k = 0; k < s->n; k++) {
+        free(s->needles[k]);
+    }
+    free(s->needles);
+    free(s->lens);
+}
+
+
+
+static unsigned char fold(unsigned char c, int icase) {
+    return (icase && c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static int same(const unsigned char *text, const unsigned char *needle, size_t n, int icase) {
+
+    if (!icase)
+        return memcmp(text, needle, n) == 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fold(text[i], 1) != needle[i])
+            return 0;
+    }
+    return 1;
+}
+
+
+
+// First occurrence of string k at or after from, or len.
+static size_t find(const searcher_t *s, int k, const unsigned char *buf, size_t from, size_t len) {
+
+    const unsigned char *needle = s->needles[k];
+    size_t n = s->lens[k];
+    if (from > len || len - from < n)
+        return len;
+
+    size_t last = len - n;          // last place the string can start
+    size_t i = from;
+
+#ifdef __SSE2__
+    // ignoring case, setting bit 5 turns both cases of a letter into the
+    // lower one; other bytes may collide and are weeded out by same()
+    unsigned char a = needle[0], z = needle[n - 1];
+    __m128i first = _mm_set1_epi8((char)a);
+    __m128i final = _mm_set1_epi8((char)z);
+    __m128i first_or = _mm_set1_epi8(s->icase && a >= 'a' && a <= 'z' ? 0x20 : 0);
+    __m128i final_or = _mm_set1_epi8(s->icase && z >= 'a' && z <= 'z' ? 0x20 : 0);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i head = _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)), first_or);
+        __m128i tail = _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + n - 1)), final_or);
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                   _mm_cmpeq_epi8(tail, final)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (same(buf + at, needle, n, s->icase))
+                return at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= last; i++) {
+        if (fold(buf[i], s->icase) == needle[0] && same(buf + i, needle, n, s->icase))
+            return i;
+    }
+    return len;
+}
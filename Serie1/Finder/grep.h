@@ -0,0 +1,27 @@
+// Content search (-s): literal strings looked for inside files.
+//
+// Each string is found with a two-byte SIMD filter: sixteen positions at
+// once are tested for its first and its last byte, and only where both
+// agree are the bytes in between compared.  Several strings are searched
+// side by side, each remembering where it occurs next, so a file is
+// still read only once.
+#ifndef GREP_H
+#define GREP_H
+
+#include <stddef.h>
+
+typedef struct {
+    int icase;
+    unsigned char **needles;        // folded when icase
+    size_t *lens;
+    int n, cap;
+} searcher_t;
+
+int searcher_add(searcher_t *s, const char *text);
+void searcher_compile(searcher_t *s, int icase);
+int searcher_binary(const char *buf, size_t len);
+void searcher_scan(const searcher_t *s, const char *buf, size_t len,
+                   int (*found)(void *arg, const char *line, size_t len, size_t line_no), void *arg);
+void searcher_free(searcher_t *s);
+
+#endif
@@ -0,0 +1,696 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "index.h"
+
+// One name seen during a build, and where its id has to go
+typedef struct {
+    const char *name;
+    uint32_t *id;
+} name_ref_t;
+
+typedef struct {
+    uint32_t name, dir;
+} file_rec_t;
+
+static int part_string(build_part_t *p, const char *name, uint32_t *off);
+static int compare_ref(const void *a, const void *b);
+static int compare_file(const void *a, const void *b);
+static uint32_t hash_child(uint32_t parent, const char *name);
+static char *dir_path(const index_t *ix, uint32_t dir, const char *name);
+static int compare_head(const index_t *ix, uint32_t block, const char *name, size_t len);
+static uint32_t find_name(const index_t *ix, const char *name, size_t len);
+static void emit_files(const index_t *ix, uint32_t id, const char *name, const char *under,
+                       void (*found)(void *arg, const char *path), void *arg);
+
+
+
+//  READING
+
+int index_open(index_t *ix, const char *file) {
+
+    memset(ix, 0, sizeof(*ix));
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(index_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const index_header_t *h = map;
+    if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION || h->size != (uint64_t)st.st_size ||
+        h->root_off >= h->size || h->names_off > h->root_off) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const char *base = map;
+    ix->map = map;
+    ix->len = st.st_size;
+    ix->hdr = h;
+    ix->dirs = (const index_dir_t *)(base + h->dirs_off);
+    ix->files = (const index_file_t *)(base + h->files_off);
+    ix->post = (const uint32_t *)(base + h->post_off);
+    ix->blocks = (const uint32_t *)(base + h->blocks_off);
+    ix->names = (const unsigned char *)(base + h->names_off);
+    ix->root = base + h->root_off;
+    return 0;
+}
+
+
+
+void index_close(index_t *ix) {
+
+    if (ix->dir_names) {
+        for (uint32_t i = 0; i < ix->hdr->ndirs; i++) {
+            free(ix->dir_names[i]);
+        }
+    }
+    free(ix->dir_names);
+    free(ix->child_hash);
+    free(ix->file_start);
+    free(ix->file_names);
+    free(ix->sub_start);
+    free(ix->sub_dirs);
+    if (ix->map) munmap(ix->map, ix->len);
+    memset(ix, 0, sizeof(*ix));
+}
+
+
+
+// Decode name id into buf (256 bytes); returns its length
+size_t index_name(const index_t *ix, uint32_t id, char *buf) {
+
+    const unsigned char *p = ix->names + ix->blocks[id / INDEX_BLOCK];
+    size_t len = *p++;
+    memcpy(buf, p, len);
+    p += len;
+
+    for (uint32_t i = 0; i < id % INDEX_BLOCK; i++) {
+        size_t shared = *p++;
+        size_t suffix = *p++;
+        memcpy(buf + shared, p, suffix);
+        p += suffix;
+        len = shared + suffix;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+
+
+// Every file whose name matches and whose path lies under `under` (an
+// absolute path, or NULL for all).  Exact names are looked up with a
+// binary search; anything else is tested once per distinct name.
+int index_query(const index_t *ix, const matcher_t *m, const char *under,
+                void (*found)(void *arg, const char *path), void *arg) {
+
+    const index_header_t *h = ix->hdr;
+
+    //  EXACT
+    if (m->names && !m->icase && m->nglobs == 0 && m->nalways == 0 && !m->has_regex) {
+        for (uint32_t i = 0; i <= m->names_mask; i++) {
+            const char *name = m->names[i];
+            if (!name)
+                continue;
+            uint32_t id = find_name(ix, name, strlen(name));
+            if (id != INDEX_NONE)
+                emit_files(ix, id, name, under, found, arg);
+        }
+        return 0;
+    }
+
+    //  SCAN
+    // the names are decoded in order, so each costs one memcpy of its suffix
+    char name[256];
+    size_t len = 0;
+    const unsigned char *p = ix->names;
+    for (uint32_t id = 0; id < h->nnames; id++) {
+        if (id % INDEX_BLOCK == 0) {
+            p = ix->names + ix->blocks[id / INDEX_BLOCK];
+            len = *p++;
+            memcpy(name, p, len);
+            p += len;
+        } else {
+            size_t shared = *p++;
+            size_t suffix = *p++;
+            memcpy(name + shared, p, suffix);
+            p += suffix;
+            len = shared + suffix;
+        }
+        name[len] = '\0';
+
+        if (ix->post[id] != ix->post[id + 1] && matcher_match(m, 0, name, len))
+            emit_files(ix, id, name, under, found, arg);
+    }
+    return 0;
+}
+
+
+
+static void emit_files(const index_t *ix, uint32_t id, const char *name, const char *under,
+                       void (*found)(void *arg, const char *path), void *arg) {
+
+    size_t under_len = under ? strlen(under) : 0;
+    for (uint32_t f = ix->post[id]; f < ix->post[id + 1]; f++) {
+        char *path = dir_path(ix, ix->files[f].dir, name);
+        if (!path) {
+            fprintf(stderr, "Out of memory\n");
+            return;
+        }
+        if (!under || (strncmp(path, under, under_len) == 0 &&
+                       (path[under_len] == '/' || under_len == 1))) {
+            found(arg, path);
+        }
+        free(path);
+    }
+}
+
+
+
+// "<root>/<dir>/.../<name>"
+static char *dir_path(const index_t *ix, uint32_t dir, const char *name) {
+
+    size_t root_len = strlen(ix->root);
+    size_t len = root_len + strlen(name) + 1;
+    for (uint32_t d = dir; d != 0; d = ix->dirs[d].parent) {
+        len += 256 + 1;
+    }
+
+    char *path = malloc(len + 1);
+    if (!path)
+        return NULL;
+
+    // components come out leaf first; build from the end
+    char *p = path + len;
+    *p = '\0';
+    size_t n = strlen(name);
+    p -= n;
+    memcpy(p, name, n);
+
+    char buf[256];
+    for (uint32_t d = dir; d != 0; d = ix->dirs[d].parent) {
+        *--p = '/';
+        n = index_name(ix, ix->dirs[d].name, buf);
+        p -= n;
+        memcpy(p, buf, n);
+    }
+    if (root_len == 0 || ix->root[root_len - 1] != '/') {
+        *--p = '/';
+    }
+    p -= root_len;
+    memcpy(p, ix->root, root_len);
+
+    memmove(path, p, strlen(p) + 1);
+    return path;
+}
+
+
+
+static int compare_head(const index_t *ix, uint32_t block, const char *name, size_t len) {
+
+    const unsigned char *p = ix->names + ix->blocks[block];
+    size_t head_len = *p++;
+    int c = memcmp(p, name, head_len < len ? head_len : len);
+    if (c != 0)
+        return c;
+    return head_len < len ? -1 : head_len > len;
+}
+
+
+
+static uint32_t find_name(const index_t *ix, const char *name, size_t len) {
+
+    uint32_t nblocks = ix->hdr->nblocks;
+    if (nblocks == 0 || len > 255)
+        return INDEX_NONE;
+
+    // last block whose first name is <= name
+    uint32_t lo = 0, hi = nblocks;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (compare_head(ix, mid, name, len) <= 0) lo = mid;
+        else hi = mid;
+    }
+
+    char buf[256];
+    uint32_t end = (lo + 1) * INDEX_BLOCK;
+    if (end > ix->hdr->nnames) end = ix->hdr->nnames;
+    for (uint32_t id = lo * INDEX_BLOCK; id < end; id++) {
+        size_t n = index_name(ix, id, buf);
+        if (n == len && memcmp(buf, name, len) == 0)
+            return id;
+    }
+    return INDEX_NONE;
+}
+
+
+
+//  REFRESH
+
+// Lookup structures for reusing an old index: directories by (parent,
+// name), and the files and subdirectories of each directory.
+int index_prepare_refresh(index_t *ix) {
+
+    const index_header_t *h = ix->hdr;
+    uint32_t nd = h->ndirs;
+
+    uint32_t size = 16;
+    while (size < 2 * nd) size *= 2;
+
+    ix->dir_names = calloc(nd ? nd : 1, sizeof(char *));
+    ix->child_hash = malloc(size * sizeof(uint32_t));
+    ix->file_start = calloc(nd + 1, sizeof(uint32_t));
+    ix->file_names = malloc((h->nfiles ? h->nfiles : 1) * sizeof(uint32_t));
+    ix->sub_start = calloc(nd + 1, sizeof(uint32_t));
+    ix->sub_dirs = malloc((nd ? nd : 1) * sizeof(uint32_t));
+    if (!ix->dir_names || !ix->child_hash || !ix->file_start || !ix->file_names ||
+        !ix->sub_start || !ix->sub_dirs) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    ix->child_mask = size - 1;
+    memset(ix->child_hash, 0xff, size * sizeof(uint32_t));
+
+    char buf[256];
+    for (uint32_t d = 0; d < nd; d++) {
+        index_name(ix, ix->dirs[d].name, buf);
+        ix->dir_names[d] = strdup(buf);
+        if (!ix->dir_names[d]) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        if (d == 0)
+            continue;
+
+        uint32_t parent = ix->dirs[d].parent;
+        uint32_t i = hash_child(parent, buf) & ix->child_mask;
+        while (ix->child_hash[i] != INDEX_NONE) i = (i + 1) & ix->child_mask;
+        ix->child_hash[i] = d;
+        ix->sub_start[parent + 1]++;
+    }
+
+    // counting sort of files by directory; within one directory they
+    // stay in name order
+    for (uint32_t f = 0; f < h->nfiles; f++) {
+        ix->file_start[ix->files[f].dir + 1]++;
+    }
+    for (uint32_t d = 0; d < nd; d++) {
+        ix->file_start[d + 1] += ix->file_start[d];
+        ix->sub_start[d + 1] += ix->sub_start[d];
+    }
+
+    uint32_t *fill = calloc(nd ? nd : 1, sizeof(uint32_t));
+    if (!fill) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (uint32_t id = 0; id < h->nnames; id++) {
+        for (uint32_t f = ix->post[id]; f < ix->post[id + 1]; f++) {
+            uint32_t d = ix->files[f].dir;
+            ix->file_names[ix->file_start[d] + fill[d]++] = id;
+        }
+    }
+    memset(fill, 0, (nd ? nd : 1) * sizeof(uint32_t));
+    for (uint32_t d = 1; d < nd; d++) {
+        uint32_t parent = ix->dirs[d].parent;
+        ix->sub_dirs[ix->sub_start[parent] + fill[parent]++] = d;
+    }
+    free(fill);
+    return 0;
+}
+
+
+
+uint32_t index_child(const index_t *ix, uint32_t dir, const char *name) {
+
+    if (dir == INDEX_NONE)
+        return INDEX_NONE;
+
+    uint32_t i = hash_child(dir, name) & ix->child_mask;
+    for (uint32_t d; (d = ix->child_hash[i]) != INDEX_NONE; i = (i + 1) & ix->child_mask) {
+        if (ix->dirs[d].parent == dir && strcmp(ix->dir_names[d], name) == 0)
+            return d;
+    }
+    return INDEX_NONE;
+}
+
+
+
+// Same directory, and its entries cannot have changed since it was read.
+// A directory modified in the second the last build started may have
+// changed again without a new mtime, so it is never trusted.
+int index_dir_unchanged(const index_t *ix, uint32_t dir, const struct stat *st) {
+
+    if (dir == INDEX_NONE)
+        return 0;
+
+    const index_dir_t *d = &ix->dirs[dir];
+    return d->dev == (uint64_t)st->st_dev && d->ino == (uint64_t)st->st_ino &&
+           d->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+           d->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+           d->mtime_sec < ix->hdr->started;
+}
+
+
+
+static uint32_t hash_child(uint32_t parent, const char *name) {
+    uint32_t h = 2166136261u ^ parent;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+
+
+//  BUILDING
+
+int builder_init(index_builder_t *b, int nparts) {
+
+    memset(b, 0, sizeof(*b));
+    b->parts = calloc(nparts, sizeof(build_part_t));
+    if (!b->parts) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    b->nparts = nparts;
+    b->started = time(NULL);
+    return 0;
+}
+
+
+
+int builder_dir(index_builder_t *b, int part, uint32_t id, uint32_t parent,
+                const char *name, const struct stat *st, int wd) {
+
+    build_part_t *p = &b->parts[part];
+    if (p->ndirs == p->dirs_cap) {
+        size_t new_cap = (p->dirs_cap == 0 ? 256 : p->dirs_cap * 2);
+        build_dir_t *tmp = realloc(p->dirs, new_cap * sizeof(build_dir_t));
+        if (!tmp)
+            return -1;
+        p->dirs = tmp;
+        p->dirs_cap = new_cap;
+    }
+
+    build_dir_t *d = &p->dirs[p->ndirs];
+    if (part_string(p, name, &d->name) != 0)
+        return -1;
+    d->id = id;
+    d->parent = parent;
+    d->mtime_sec = st->st_mtim.tv_sec;
+    d->mtime_nsec = st->st_mtim.tv_nsec;
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->wd = wd;
+    p->ndirs++;
+    return 0;
+}
+
+
+
+int builder_file(index_builder_t *b, int part, uint32_t dir, const char *name) {
+
+    build_part_t *p = &b->parts[part];
+    if (p->nfiles == p->files_cap) {
+        size_t new_cap = (p->files_cap == 0 ? 1024 : p->files_cap * 2);
+        build_file_t *tmp = realloc(p->files, new_cap * sizeof(build_file_t));
+        if (!tmp)
+            return -1;
+        p->files = tmp;
+        p->files_cap = new_cap;
+    }
+
+    build_file_t *f = &p->files[p->nfiles];
+    if (part_string(p, name, &f->name) != 0)
+        return -1;
+    f->dir = dir;
+    p->nfiles++;
+    return 0;
+}
+
+
+
+// Merge what the workers saw, and replace `file` atomically: queries
+// running meanwhile keep the old mapping.
+int builder_write(index_builder_t *b, const char *file, const char *root) {
+
+    size_t ndirs = 0, nfiles = 0;
+    uint32_t max_id = 0;
+    for (int i = 0; i < b->nparts; i++) {
+        ndirs += b->parts[i].ndirs;
+        nfiles += b->parts[i].nfiles;
+        for (size_t j = 0; j < b->parts[i].ndirs; j++) {
+            if (b->parts[i].dirs[j].id + 1 > max_id) max_id = b->parts[i].dirs[j].id + 1;
+        }
+    }
+    if (ndirs == 0) {
+        fprintf(stderr, "Error: nothing to index\n");
+        return -1;
+    }
+
+    // walk ids have gaps (directories that could not be opened); renumber
+    // the rest in id order, which keeps parents before children and the
+    // root at 0
+    uint32_t *renum = malloc(max_id * sizeof(uint32_t));
+    build_dir_t **by_id = calloc(max_id, sizeof(build_dir_t *));
+    const char **dir_str = calloc(max_id, sizeof(char *));
+    index_dir_t *dirs = calloc(ndirs, sizeof(index_dir_t));
+    file_rec_t *files = malloc((nfiles ? nfiles : 1) * sizeof(file_rec_t));
+    name_ref_t *refs = malloc((ndirs + nfiles) * sizeof(name_ref_t));
+    uint32_t *post = NULL, *blocks = NULL;
+    unsigned char *names = NULL;
+    int ok = -1;
+
+    if (!renum || !by_id || !dir_str || !dirs || !files || !refs) {
+        fprintf(stderr, "Out of memory\n");
+    } else {
+        for (int i = 0; i < b->nparts; i++) {
+            build_part_t *p = &b->parts[i];
+            for (size_t j = 0; j < p->ndirs; j++) {
+                by_id[p->dirs[j].id] = &p->dirs[j];
+                dir_str[p->dirs[j].id] = p->strings + p->dirs[j].name;
+            }
+        }
+
+        uint32_t n = 0;
+        for (uint32_t id = 0; id < max_id; id++) {
+            renum[id] = by_id[id] ? n++ : INDEX_NONE;
+        }
+
+        size_t nrefs = 0;
+        for (uint32_t id = 0; id < max_id; id++) {
+            build_dir_t *d = by_id[id];
+            if (!d)
+                continue;
+            index_dir_t *out = &dirs[renum[id]];
+            out->parent = d->parent == INDEX_NONE ? INDEX_NONE : renum[d->parent];
+            out->mtime_sec = d->mtime_sec;
+            out->mtime_nsec = d->mtime_nsec;
+            out->dev = d->dev;
+            out->ino = d->ino;
+            refs[nrefs].name = dir_str[id];
+            refs[nrefs].id = &out->name;
+            nrefs++;
+        }
+
+        size_t nf = 0;
+        for (int i = 0; i < b->nparts; i++) {
+            build_part_t *p = &b->parts[i];
+            for (size_t j = 0; j < p->nfiles; j++) {
+                if (renum[p->files[j].dir] == INDEX_NONE)
+                    continue;
+                files[nf].dir = renum[p->files[j].dir];
+                refs[nrefs].name = p->strings + p->files[j].name;
+                refs[nrefs].id = &files[nf].name;
+                nrefs++;
+                nf++;
+            }
+        }
+        nfiles = nf;
+
+        //  NAMES
+        qsort(refs, nrefs, sizeof(name_ref_t), compare_ref);
+
+        uint32_t nnames = 0;
+        size_t names_len = 0;
+        for (size_t i = 0; i < nrefs; i++) {
+            if (i == 0 || strcmp(refs[i].name, refs[i - 1].name) != 0) {
+                nnames++;
+                names_len += strlen(refs[i].name) + 2;
+            }
+            *refs[i].id = nnames - 1;
+        }
+
+        uint32_t nblocks = (nnames + INDEX_BLOCK - 1) / INDEX_BLOCK;
+        post = calloc(nnames + 1, sizeof(uint32_t));
+        blocks = malloc((nblocks ? nblocks : 1) * sizeof(uint32_t));
+        names = malloc(names_len ? names_len : 1);
+        if (!post || !blocks || !names) {
+            fprintf(stderr, "Out of memory\n");
+        } else {
+            // front coding against the previous distinct name
+            size_t off = 0;
+            const char *prev = NULL;
+            uint32_t id = 0;
+            for (size_t i = 0; i < nrefs; i++) {
+                if (prev && strcmp(refs[i].name, prev) == 0)
+                    continue;
+
+                const char *s = refs[i].name;
+                size_t len = strlen(s);
+                if (id % INDEX_BLOCK == 0) {
+                    blocks[id / INDEX_BLOCK] = off;
+                    names[off++] = len;
+                    memcpy(names + off, s, len);
+                    off += len;
+                } else {
+                    size_t shared = 0;
+                    while (prev[shared] && prev[shared] == s[shared]) shared++;
+                    names[off++] = shared;
+                    names[off++] = len - shared;
+                    memcpy(names + off, s + shared, len - shared);
+                    off += len - shared;
+                }
+                prev = s;
+                id++;
+            }
+            names_len = off;
+
+            //  FILES
+            qsort(files, nfiles, sizeof(file_rec_t), compare_file);
+            for (size_t i = 0; i < nfiles; i++) {
+                post[files[i].name + 1]++;
+            }
+            for (uint32_t i = 0; i < nnames; i++) {
+                post[i + 1] += post[i];
+            }
+
+            //  WRITE
+            index_header_t h;
+            memset(&h, 0, sizeof(h));
+            h.magic = INDEX_MAGIC;
+            h.version = INDEX_VERSION;
+            h.ndirs = n;
+            h.nfiles = nfiles;
+            h.nnames = nnames;
+            h.nblocks = nblocks;
+            h.started = b->started;
+            h.dirs_off = (sizeof(h) + 7) & ~7ul;
+            h.files_off = h.dirs_off + n * sizeof(index_dir_t);
+            h.post_off = h.files_off + nfiles * sizeof(index_file_t);
+            h.blocks_off = h.post_off + (nnames + 1) * sizeof(uint32_t);
+            h.names_off = h.blocks_off + nblocks * sizeof(uint32_t);
+            h.root_off = h.names_off + names_len;
+            h.size = h.root_off + strlen(root) + 1;
+
+            char tmp[4096];
+            snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+            FILE *out = fopen(tmp, "w");
+            if (!out) {
+                perror(tmp);
+            } else {
+                static const char zero[8];
+                fwrite(&h, sizeof(h), 1, out);
+                fwrite(zero, 1, h.dirs_off - sizeof(h), out);
+                fwrite(dirs, sizeof(index_dir_t), n, out);
+                for (size_t i = 0; i < nfiles; i++) {
+                    index_file_t f = { files[i].dir };
+                    fwrite(&f, sizeof(f), 1, out);
+                }
+                fwrite(post, sizeof(uint32_t), nnames + 1, out);
+                fwrite(blocks, sizeof(uint32_t), nblocks, out);
+                fwrite(names, 1, names_len, out);
+                fwrite(root, 1, strlen(root) + 1, out);
+
+                if (ferror(out) | fclose(out)) {
+                    perror(tmp);
+                    unlink(tmp);
+                } else if (rename(tmp, file) == -1) {
+                    perror(file);
+                    unlink(tmp);
+                } else {
+                    ok = 0;
+                }
+            }
+        }
+    }
+
+    free(renum);
+    free(by_id);
+    free(dir_str);
+    free(dirs);
+    free(files);
+    free(refs);
+    free(post);
+    free(blocks);
+    free(names);
+    return ok;
+}
+
+
+
+void builder_free(index_builder_t *b) {
+
+    for (int i = 0; i < b->nparts; i++) {
+        free(b->parts[i].dirs);
+        free(b->parts[i].files);
+        free(b->parts[i].strings);
+    }
+    free(b->parts);
+    memset(b, 0, sizeof(*b));
+}
+
+
+
+static int part_string(build_part_t *p, const char *name, uint32_t *off) {
+
+    size_t len = strlen(name) + 1;
+    if (p->len + len > p->cap) {
+        size_t new_cap = (p->cap == 0 ? 65536 : p->cap * 2);
+        while (new_cap < p->len + len) new_cap *= 2;
+        char *tmp = realloc(p->strings, new_cap);
+        if (!tmp)
+            return -1;
+        p->strings = tmp;
+        p->cap = new_cap;
+    }
+
+    memcpy(p->strings + p->len, name, len);
+    *off = p->len;
+    p->len += len;
+    return 0;
+}
+
+
+
+static int compare_ref(const void *a, const void *b) {
+    return strcmp(((const name_ref_t *)a)->name, ((const name_ref_t *)b)->name);
+}
+
+
+
+static int compare_file(const void *a, const void *b) {
+    const file_rec_t *x = a, *y = b;
+    if (x->name != y->name)
+        return x->name < y->name ? -1 : 1;
+    return x->dir < y->dir ? -1 : x->dir > y->dir;
+}
@@ -0,0 +1,117 @@
+// Persistent file-name index: -B builds or refreshes it, -I answers
+// queries from it without walking the tree.
+//
+// One file, written once and then only ever mapped read-only:
+//   header
+//   dirs     index_dir_t[ndirs]; dir 0 is the root, parents come first
+//   files    index_file_t[nfiles], ordered by name
+//   post     uint32_t[nnames + 1]: the files named i are post[i] .. post[i+1]
+//   blocks   uint32_t[nblocks]: where each block of INDEX_BLOCK names starts
+//   names    every distinct file and directory name, sorted and front
+//            coded: the first of a block in full (length, bytes), the
+//            rest as (shared prefix length, suffix length, suffix)
+//   root     absolute path of the indexed directory
+//
+// A refresh reuses the entries of every directory whose mtime did not
+// change and only reads the others again.
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "match.h"
+
+#define INDEX_MAGIC 0x58444946u         // "FIDX"
+#define INDEX_VERSION 1
+#define INDEX_BLOCK 16
+#define INDEX_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ndirs, nfiles, nnames, nblocks;
+    uint64_t dirs_off, files_off, post_off, blocks_off, names_off, root_off;
+    uint64_t size;
+    int64_t started;                    // time(NULL) when the build began
+} index_header_t;
+
+typedef struct {
+    uint32_t parent;                    // INDEX_NONE for the root
+    uint32_t name;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t dev, ino;
+} index_dir_t;
+
+typedef struct {
+    uint32_t dir;
+} index_file_t;
+
+// A mapped index
+typedef struct {
+    void *map;
+    size_t len;
+    const index_header_t *hdr;
+    const index_dir_t *dirs;
+    const index_file_t *files;
+    const uint32_t *post;
+    const uint32_t *blocks;
+    const unsigned char *names;
+    const char *root;
+
+    // filled in by index_prepare_refresh
+    char **dir_names;                   // decoded name of every directory
+    uint32_t *child_hash;               // (parent, name) -> dir
+    uint32_t child_mask;
+    uint32_t *file_start, *file_names;  // files of dir d by name id
+    uint32_t *sub_start, *sub_dirs;     // subdirectories of dir d
+} index_t;
+
+// What one worker saw during a build
+typedef struct {
+    uint32_t id, parent;
+    uint32_t name;                      // offset into the part's strings
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t dev, ino;
+    int32_t wd;                         // -D: inotify watch, or -1
+} build_dir_t;
+
+typedef struct {
+    uint32_t dir;
+    uint32_t name;                      // offset into the part's strings
+} build_file_t;
+
+typedef struct {
+    build_dir_t *dirs;
+    size_t ndirs, dirs_cap;
+    build_file_t *files;
+    size_t nfiles, files_cap;
+    char *strings;
+    size_t len, cap;
+} build_part_t;
+
+typedef struct {
+    build_part_t *parts;                // one per worker, no locking
+    int nparts;
+    int64_t started;
+} index_builder_t;
+
+int index_open(index_t *ix, const char *file);
+void index_close(index_t *ix);
+size_t index_name(const index_t *ix, uint32_t id, char *buf);
+int index_query(const index_t *ix, const matcher_t *m, const char *under,
+                void (*found)(void *arg, const char *path), void *arg);
+
+int index_prepare_refresh(index_t *ix);
+uint32_t index_child(const index_t *ix, uint32_t dir, const char *name);
+int index_dir_unchanged(const index_t *ix, uint32_t dir, const struct stat *st);
+
+int builder_init(index_builder_t *b, int nparts);
+int builder_dir(index_builder_t *b, int part, uint32_t id, uint32_t parent,
+                const char *name, const struct stat *st, int wd);
+int builder_file(index_builder_t *b, int part, uint32_t dir, const char *name);
+int builder_write(index_builder_t *b, const char *file, const char *root);
+void builder_free(index_builder_t *b);
+
+#endif
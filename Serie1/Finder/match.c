@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "match.h"
+
+static unsigned char fold(unsigned char c, int icase);
+static uint32_t hash_name(const char *s, size_t len);
+static int build_names(matcher_t *m);
+static int build_automaton(matcher_t *m, char **literals);
+static int build_regex(matcher_t *m, int nthreads);
+static char *glob_literal(const char *pat, int icase);
+static int glob_match(const char *pat, const char *name, size_t len, int icase);
+static size_t prefilter(const matcher_t *m, const unsigned char *name, size_t len);
+
+
+
+int matcher_add(matcher_t *m, const char *pattern, int kind) {
+
+    if (m->npatterns == m->cap) {
+        int new_cap = (m->cap == 0 ? 16 : m->cap * 2);
+        pattern_t *tmp = realloc(m->patterns, new_cap * sizeof(pattern_t));
+        if (!tmp) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        m->patterns = tmp;
+        m->cap = new_cap;
+    }
+
+    char *text = strdup(pattern);
+    if (!text) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    m->patterns[m->npatterns].text = text;
+    m->patterns[m->npatterns].kind = kind;
+    m->npatterns++;
+    return 0;
+}
+
+
+
+// nthreads: how many threads will call matcher_match at the same time,
+// each with its own index below that.
+int matcher_compile(matcher_t *m, int icase, int nthreads) {
+
+    m->icase = icase;
+
+    if (build_names(m) != 0)
+        return -1;
+
+    // split the globs: a literal run goes into the automaton, anything
+    // without one has to be tried on every name
+    int nglob = 0;
+    for (int i = 0; i < m->npatterns; i++) {
+        if (m->patterns[i].kind == MATCH_GLOB) nglob++;
+    }
+
+    char **literals = calloc(nglob ? nglob : 1, sizeof(char *));
+    m->globs = malloc((nglob ? nglob : 1) * sizeof(int));
+    m->always = malloc((nglob ? nglob : 1) * sizeof(int));
+    if (!literals || !m->globs || !m->always) {
+        fprintf(stderr, "Out of memory\n");
+        free(literals);
+        return -1;
+    }
+
+    int ok = 0;
+    for (int i = 0; i < m->npatterns && ok == 0; i++) {
+        if (m->patterns[i].kind != MATCH_GLOB)
+            continue;
+
+        char *lit = glob_literal(m->patterns[i].text, icase);
+        if (!lit) {
+            fprintf(stderr, "Out of memory\n");
+            ok = -1;
+        } else if (lit[0] == '\0') {
+            free(lit);
+            m->always[m->nalways++] = i;
+        } else {
+            literals[m->nglobs] = lit;
+            m->globs[m->nglobs++] = i;
+        }
+    }
+
+    if (ok == 0 && m->nglobs > 0)
+        ok = build_automaton(m, literals);
+
+    for (int i = 0; i < m->nglobs; i++) {
+        free(literals[i]);
+    }
+    free(literals);
+
+    if (ok == 0)
+        ok = build_regex(m, nthreads);
+    return ok;
+}
+
+
+
+int matcher_match(const matcher_t *m, int thread, const char *name, size_t len) {
+
+    //  EXACT
+    if (m->names && len < 256 && (m->lengths[len >> 6] >> (len & 63) & 1)) {
+        char folded[256];
+        const char *key = name;
+        if (m->icase) {
+            for (size_t i = 0; i < len; i++) {
+                folded[i] = fold(name[i], 1);
+            }
+            key = folded;
+        }
+
+        uint32_t i = hash_name(key, len) & m->names_mask;
+        while (m->names[i]) {
+            if (strncmp(m->names[i], key, len) == 0 && m->names[i][len] == '\0')
+                return 1;
+            i = (i + 1) & m->names_mask;
+        }
+    }
+
+    //  GLOB
+    for (int i = 0; i < m->nalways; i++) {
+        if (glob_match(m->patterns[m->always[i]].text, name, len, m->icase))
+            return 1;
+    }
+
+    if (m->nglobs > 0) {
+        const unsigned char *s = (const unsigned char *)name;
+        int state = 0;
+        for (size_t i = prefilter(m, s, len); i < len; i++) {
+            state = m->goto_table[state * m->nclasses + m->classes[s[i]]];
+
+            // every literal ending here: the state's own, then those of
+            // its suffixes
+            int t = m->out[state] != -1 ? state : m->out_link[state];
+            for (; t != -1; t = m->out_link[t]) {
+                for (int g = m->out[t]; g != -1; g = m->out_next[g]) {
+                    if (glob_match(m->patterns[m->globs[g]].text, name, len, m->icase))
+                        return 1;
+                }
+            }
+        }
+    }
+
+    //  REGEX
+    if (m->has_regex) {
+        if (regexec(&m->regex[thread % m->nregex], name, 0, NULL, 0) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+
+void matcher_free(matcher_t *m) {
+
+    for (int i = 0; i < m->npatterns; i++) {
+        free(m->patterns[i].text);
+    }
+    free(m->patterns);
+
+    if (m->names) {
+        for (uint32_t i = 0; i <= m->names_mask; i++) {
+            free(m->names[i]);
+        }
+        free(m->names);
+    }
+
+    free(m->goto_table);
+    free(m->out);
+    free(m->out_next);
+    free(m->out_link);
+    free(m->globs);
+    free(m->always);
+
+    for (int i = 0; i < m->nregex; i++) {
+        regfree(&m->regex[i]);
+    }
+    free(m->regex);
+
+    memset(m, 0, sizeof(*m));
+}
+
+
+
+static unsigned char fold(unsigned char c, int icase) {
+    return (icase && c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+
+// FNV-1a
+static uint32_t hash_name(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+
+
+static int build_names(matcher_t *m) {
+
+    int n = 0;
+    for (int i = 0; i < m->npatterns; i++) {
+        if (m->patterns[i].kind == MATCH_EXACT) n++;
+    }
+    if (n == 0)
+        return 0;
+
+    // at most half full
+    uint32_t size = 16;
+    while (size < 2u * n) size *= 2;
+
+    m->names = calloc(size, sizeof(char *));
+    if (!m->names) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    m->names_mask = size - 1;
+
+    for (int i = 0; i < m->npatterns; i++) {
+        if (m->patterns[i].kind != MATCH_EXACT)
+            continue;
+
+        size_t len = strlen(m->patterns[i].text);
+        if (len >= 256)
+            continue;     // longer than any file name
+
+        char *key = strdup(m->patterns[i].text);
+        if (!key) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        for (size_t j = 0; j < len; j++) {
+            key[j] = fold(key[j], m->icase);
+        }
+
+        uint32_t h = hash_name(key, len) & m->names_mask;
+        while (m->names[h] && strcmp(m->names[h], key) != 0) {
+            h = (h + 1) & m->names_mask;
+        }
+        if (m->names[h]) {
+            free(key);    // duplicate
+            continue;
+        }
+        m->names[h] = key;
+        m->lengths[len >> 6] |= (uint64_t)1 << (len & 63);
+    }
+    return 0;
+}
+
+
+
+// Aho-Corasick over the glob literals, as a full transition table.  Only
+// bytes that occur in some literal get their own column; every other byte
+// shares column 0, which always leads back to the root.
+static int build_automaton(matcher_t *m, char **literals) {
+
+    size_t total = 1;
+    int ncl = 1;
+    for (int i = 0; i < m->nglobs; i++) {
+        for (const unsigned char *p = (const unsigned char *)literals[i]; *p; p++) {
+            if (m->classes[*p] == 0) {
+                m->classes[*p] = ncl;
+                if (m->icase && *p >= 'a' && *p <= 'z')
+                    m->classes[*p - ('a' - 'A')] = ncl;
+                ncl++;
+            }
+            total++;
+        }
+
+        unsigned char c = literals[i][0];
+        m->first[c] = 1;
+        if (m->icase && c >= 'a' && c <= 'z')
+            m->first[c - ('a' - 'A')] = 1;
+    }
+    m->nclasses = ncl;
+
+    m->nfirst = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!m->first[c])
+            continue;
+        if (m->nfirst < 4)
+            m->first_bytes[m->nfirst] = c;
+        m->nfirst++;
+    }
+
+    m->goto_table = malloc(total * ncl * sizeof(int32_t));
+    m->out = malloc(total * sizeof(int32_t));
+    m->out_link = malloc(total * sizeof(int32_t));
+    m->out_next = malloc(m->nglobs * sizeof(int32_t));
+    int32_t *fail = malloc(total * sizeof(int32_t));
+    int32_t *queue = malloc(total * sizeof(int32_t));
+    if (!m->goto_table || !m->out || !m->out_link || !m->out_next || !fail || !queue) {
+        fprintf(stderr, "Out of memory\n");
+        free(fail);
+        free(queue);
+        return -1;
+    }
+
+    for (size_t i = 0; i < total * ncl; i++) {
+        m->goto_table[i] = -1;
+    }
+    for (size_t i = 0; i < total; i++) {
+        m->out[i] = -1;
+        m->out_link[i] = -1;
+    }
+
+    //  TRIE
+    int nstates = 1;
+    for (int i = 0; i < m->nglobs; i++) {
+        int s = 0;
+        for (const unsigned char *p = (const unsigned char *)literals[i]; *p; p++) {
+            int32_t *next = &m->goto_table[s * ncl + m->classes[*p]];
+            if (*next == -1) {
+                *next = nstates++;
+            }
+            s = *next;
+        }
+        m->out_next[i] = m->out[s];
+        m->out[s] = i;
+    }
+    m->nstates = nstates;
+
+    //  FAILURE LINKS
+    // breadth first, turning missing edges into the edge of the failure
+    // state so the scan never has to follow links
+    int head = 0, tail = 0;
+    for (int c = 0; c < ncl; c++) {
+        int32_t *next = &m->goto_table[c];
+        if (*next == -1) {
+            *next = 0;
+        } else {
+            fail[*next] = 0;
+            queue[tail++] = *next;
+        }
+    }
+
+    while (head < tail) {
+        int s = queue[head++];
+        for (int c = 0; c < ncl; c++) {
+            int32_t *next = &m->goto_table[s * ncl + c];
+            int via_fail = m->goto_table[fail[s] * ncl + c];
+            if (*next == -1) {
+                *next = via_fail;
+                continue;
+            }
+            int child = *next;
+            fail[child] = via_fail;
+            m->out_link[child] = m->out[via_fail] != -1 ? via_fail : m->out_link[via_fail];
+            queue[tail++] = child;
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+
+
+// All regular expressions as one alternation, compiled once per thread.
+// Each one is compiled on its own first so errors name the culprit.
+static int build_regex(matcher_t *m, int nthreads) {
+
+    int flags = REG_EXTENDED | REG_NOSUB | (m->icase ? REG_ICASE : 0);
+    size_t len = 1;
+    int count = 0;
+
+    for (int i = 0; i < m->npatterns; i++) {
+        if (m->patterns[i].kind != MATCH_REGEX)
+            continue;
+
+        regex_t re;
+        int rc = regcomp(&re, m->patterns[i].text, flags);
+        if (rc != 0) {
+            char msg[256];
+            regerror(rc, &re, msg, sizeof(msg));
+            fprintf(stderr, "Error: bad regex '%s': %s\n", m->patterns[i].text, msg);
+            return -1;
+        }
+        regfree(&re);
+
+        len += strlen(m->patterns[i].text) + 3;
+        count++;
+    }
+    if (count == 0)
+        return 0;
+
+    char *all = malloc(len);
+    m->regex = calloc(nthreads > 0 ? nthreads : 1, sizeof(regex_t));
+    if (!all || !m->regex) {
+        fprintf(stderr, "Out of memory\n");
+        free(all);
+        return -1;
+    }
+
+    char *p = all;
+    for (int i = 0; i < m->npatterns; i++) {
+        if (m->patterns[i].kind != MATCH_REGEX)
+            continue;
+        p += sprintf(p, "%s(%s)", p == all ? "" : "|", m->patterns[i].text);
+    }
+
+    int ok = 0;
+    for (int i = 0; i < (nthreads > 0 ? nthreads : 1) && ok == 0; i++) {
+        if (regcomp(&m->regex[i], all, flags) != 0) {
+            fprintf(stderr, "Error: cannot combine regular expressions\n");
+            ok = -1;
+        } else {
+            m->nregex++;
+        }
+    }
+    m->has_regex = ok == 0;
+
+    free(all);
+    return ok;
+}
+
+
+
+// Longest run of plain characters in a glob, folded; "" if there is none.
+// Any name the glob matches contains it.
+static char *glob_literal(const char *pat, int icase) {
+
+    size_t n = strlen(pat);
+    char *best = calloc(1, n + 1);
+    char *run = malloc(n + 1);
+    if (!best || !run) {
+        free(best);
+        free(run);
+        return NULL;
+    }
+
+    size_t best_len = 0, run_len = 0;
+    for (const char *p = pat; ; p++) {
+
+        int plain = *p != '\0' && *p != '*' && *p != '?' && *p != '[';
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+
+        if (plain) {
+            run[run_len++] = fold(*p, icase);
+            continue;
+        }
+
+        if (run_len > best_len) {
+            memcpy(best, run, run_len);
+            best[run_len] = '\0';
+            best_len = run_len;
+        }
+        run_len = 0;
+
+        if (*p == '\0')
+            break;
+
+        // skip a bracket expression; an unclosed '[' is an ordinary
+        // character to glob_match, but not worth keeping here
+        if (*p == '[') {
+            const char *q = p + 1;
+            if (*q == '!' || *q == '^') q++;
+            if (*q == ']') q++;
+            while (*q && *q != ']') q++;
+            if (*q == ']') p = q;
+        }
+    }
+
+    free(run);
+    return best;
+}
+
+
+
+// Match one bracket expression at *pp against c; advances *pp past it.
+// Returns -1 if the bracket is not closed.
+static int match_bracket(const char **pp, unsigned char c, int icase) {
+
+    const char *p = *pp + 1;
+    int negate = 0, hit = 0;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+
+    int first = 1;
+    while (*p && (*p != ']' || first)) {
+        first = 0;
+        unsigned char lo = *p == '\\' && p[1] ? *++p : *p;
+        unsigned char hi = lo;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            p += 2;
+            hi = *p == '\\' && p[1] ? *++p : *p;
+        }
+        if (fold(lo, icase) <= fold(c, icase) && fold(c, icase) <= fold(hi, icase))
+            hit = 1;
+        p++;
+    }
+    if (*p != ']')
+        return -1;
+
+    *pp = p + 1;
+    return hit != negate;
+}
+
+
+
+// fnmatch(3) without FNM_PATHNAME: '*', '?', '[...]' and '\' escapes.
+// A '*' only ever needs to remember the last star; on a mismatch it
+// swallows one more character and retries.
+static int glob_match(const char *pat, const char *name, size_t len, int icase) {
+
+    const char *star = NULL;
+    size_t star_pos = 0, i = 0;
+    const char *p = pat;
+
+    while (i < len) {
+        if (*p == '*') {
+            star = ++p;
+            star_pos = i;
+            continue;
+        }
+
+        // 1 or 0 for a bracket expression, -1 for anything else
+        // (including an unclosed '[', which is then a literal)
+        const char *q = p;
+        int r = *p == '[' ? match_bracket(&q, name[i], icase) : -1;
+        if (r == 1) {
+            p = q;
+            i++;
+            continue;
+        }
+
+        if (r == -1 && *p != '\0' &&
+            (*p == '?' || fold(*p == '\\' && p[1] ? p[1] : *p, icase) == fold(name[i], icase))) {
+            p += (*p == '\\' && p[1]) ? 2 : 1;
+            i++;
+            continue;
+        }
+
+        if (!star)
+            return 0;
+        p = star;
+        i = ++star_pos;
+    }
+
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+
+
+// First position where a literal could start, or len.  With at most four
+// possible first bytes, sixteen name bytes are compared at once.
+static size_t prefilter(const matcher_t *m, const unsigned char *name, size_t len) {
+
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (m->nfirst <= 4) {
+        __m128i b[4];
+        for (int k = 0; k < 4; k++) {
+            b[k] = _mm_set1_epi8((char)m->first_bytes[k < m->nfirst ? k : 0]);
+        }
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(name + i));
+            __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b[0]), _mm_cmpeq_epi8(v, b[1])),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, b[2]), _mm_cmpeq_epi8(v, b[3])));
+            int mask = _mm_movemask_epi8(hit);
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (m->first[name[i]])
+            return i;
+    }
+    return len;
+}
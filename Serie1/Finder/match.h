@@ -0,0 +1,60 @@
+// Name matcher: any number of exact names, globs and regular expressions,
+// compiled once and then tested against every entry of the walk.
+//
+// Exact names go into a hash set behind a length filter.  Every glob
+// contributes its longest literal run to one Aho-Corasick automaton, so a
+// name is scanned once for all globs and only the globs whose literal
+// occurs in it are run in full.  Regular expressions are joined into a
+// single alternation.
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <regex.h>
+
+enum { MATCH_EXACT, MATCH_GLOB, MATCH_REGEX };
+
+typedef struct {
+    char *text;
+    int kind;
+} pattern_t;
+
+typedef struct {
+    int icase;
+
+    pattern_t *patterns;
+    int npatterns, cap;
+
+    // exact names, folded when icase
+    char **names;
+    uint32_t names_mask;            // hash table size - 1
+    uint64_t lengths[4];            // bit n: some name is n bytes long
+
+    // glob literals
+    int32_t *goto_table;            // states x classes
+    int32_t *out;                   // first glob ending in each state, or -1
+    int32_t *out_next;              // next glob with a literal ending in the same place
+    int32_t *out_link;              // nearest suffix state with output, or -1
+    int *globs;                     // pattern index of each glob
+    int nglobs;
+    int *always;                    // globs without literal, e.g. "*"
+    int nalways;
+    int nstates, nclasses;
+    unsigned char classes[256];     // byte -> class, 0 for bytes in no literal
+    unsigned char first[256];       // bytes a literal can start with
+    unsigned char first_bytes[4];   // the same, when there are at most four
+    int nfirst;
+
+    // one compiled copy per worker: glibc serialises regexec per regex_t
+    regex_t *regex;
+    int nregex;
+    int has_regex;
+} matcher_t;
+
+int matcher_add(matcher_t *m, const char *pattern, int kind);
+int matcher_compile(matcher_t *m, int icase, int nthreads);
+int matcher_match(const matcher_t *m, int thread, const char *name, size_t len);
+void matcher_free(matcher_t *m);
+
+#endif
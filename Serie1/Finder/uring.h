@@ -0,0 +1,166 @@
+// Minimal io_uring wrapper used by the -u backend.
+//
+// Talks to the kernel through the raw syscalls so the finder has no
+// library dependency.  Each worker owns one ring and is the only thread
+// that touches it, so the only ordering needed is against the kernel:
+// acquire loads of the indices the kernel moves, release stores of the
+// ones we move.
+#ifndef URING_H
+#define URING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned entries;
+    unsigned sq_local;   // our tail; entries past *sq_tail are not published yet
+    unsigned long enters;    // io_uring_enter calls made, for -v
+} uring_t;
+
+static inline void uring_exit(uring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static inline int uring_map(uring_t *r, const struct io_uring_params *p) {
+    r->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    r->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    void *ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+        return -1;
+    r->sq_ptr = ptr;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED)
+            return -1;
+        r->cq_ptr = ptr;
+    }
+
+    r->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               r->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+        return -1;
+    r->sqes = ptr;
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p->sq_off.array);
+    r->cq_head = (unsigned *)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    r->sq_local = *r->sq_tail;
+    return 0;
+}
+
+// -1 with errno set when io_uring is missing or not allowed here
+static inline int uring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return -1;
+    }
+    r->entries = p.sq_entries;
+
+    if (uring_map(r, &p) != 0) {
+        int err = errno;
+        uring_exit(r);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the running kernel implements an opcode
+static inline int uring_supports(uring_t *r, int op) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe)
+        return 0;
+
+    int ok = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// Next free submission entry, zeroed; NULL when the ring is full
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local - head >= r->entries)
+        return NULL;
+
+    unsigned idx = r->sq_local & *r->sq_mask;
+    r->sq_array[idx] = idx;
+    r->sq_local++;
+
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Hand every queued entry to the kernel in one call, optionally waiting
+// for wait_nr completions.
+static inline int uring_submit(uring_t *r, unsigned wait_nr) {
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    unsigned queued = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (!queued && !wait_nr)
+        return 0;
+
+    int ret;
+    do {
+        r->enters++;
+        ret = syscall(__NR_io_uring_enter, r->fd, queued, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Oldest unseen completion, or NULL
+static inline struct io_uring_cqe *uring_peek(uring_t *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_seen(uring_t *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif